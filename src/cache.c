@@ -0,0 +1,194 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+#define CACHE_MAGIC     "DSOFMAP2"
+
+// Host endian, the cache never leaves the machine
+struct cache_hdr_t {
+    char magic[8];
+    uint64_t size;                          // Source file identity
+    int64_t mtime_sec, mtime_nsec;
+    int64_t ctime_sec, ctime_nsec;
+    uint32_t page_size, pages, used_pages;
+    uint32_t stripped;                      // Image data is in <digest>.img, not in the source
+    uint32_t leaf;                          // MD5 tree leaf size, 0 for a plain MD5
+    char digest[33];
+};
+
+static int cache_dir(char *dir, size_t len)
+{
+    const char *env = getenv("DSOFLASH_CACHE");
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int n;
+
+    if (env) {
+        n = snprintf(dir, len, "%s", env);
+    } else if (xdg && *xdg) {
+        n = snprintf(dir, len, "%s/dsoflash", xdg);
+    } else if (home && *home) {
+        n = snprintf(dir, len, "%s/.cache/dsoflash", home);
+    } else {
+        return 0;
+    }
+    return n > 0 && (size_t)n < len;
+}
+
+static int cache_mkdir(char *dir)
+{
+    for (char *p = strchr(dir + 1, '/'); ; p = strchr(p + 1, '/')) {
+        if (p) {
+            *p = 0;
+        }
+        int r = mkdir(dir, 0755);
+        if (p) {
+            *p = '/';
+        }
+        if (r != 0 && errno != EEXIST) {
+            return 0;
+        }
+        if (!p) {
+            return 1;
+        }
+    }
+}
+
+static int cache_map_path(char *path, size_t len, const char *dir, const struct stat *st)
+{
+    int n = snprintf(path, len, "%s/%llx-%llx.map", dir, (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+    return n > 0 && (size_t)n < len;
+}
+
+static void cache_identity(struct cache_hdr_t *h, const struct stat *st)
+{
+    memcpy(h->magic, CACHE_MAGIC, sizeof (h->magic));
+    h->size = st->st_size;
+    h->mtime_sec = st->st_mtim.tv_sec;
+    h->mtime_nsec = st->st_mtim.tv_nsec;
+    h->ctime_sec = st->st_ctim.tv_sec;
+    h->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+// On a hit img is ready for writing, as after image_open() and image_scan() with
+// the page size returned; the caller checks that it is the one of the flash
+int cache_load(struct image_t *img, const char *file, uint32_t leaf, char *digest, uint32_t *page_size)
+{
+    struct cache_hdr_t h, want;
+    struct stat st;
+    char dir[4096], path[4096 + 80];
+    uint8_t *used = NULL;
+    FILE *f;
+
+    if (!cache_dir(dir, sizeof (dir)) || !*dir || stat(file, &st) != 0 || !cache_map_path(path, sizeof (path), dir, &st)) {
+        return 0;
+    }
+    if (!(f = fopen(path, "rb"))) {
+        return 0;
+    }
+    memset(&want, 0, sizeof (want));
+    cache_identity(&want, &st);
+    int ok = fread(&h, sizeof (h), 1, f) == 1
+          && memcmp(&h, &want, offsetof(struct cache_hdr_t, page_size)) == 0
+          && h.page_size && h.pages
+          && h.leaf == leaf                                         // A digest of the other kind can't be checked
+          && h.digest[32] == 0
+          && (used = malloc((h.pages + 7) / 8))
+          && fread(used, (h.pages + 7) / 8, 1, f) == 1;
+    fclose(f);
+
+    if (ok && h.stripped) {
+        snprintf(path, sizeof (path), "%s/%s.img", dir, h.digest);
+        ok = image_open(img, path) && img->size == (size_t)h.page_size * h.pages;
+    } else if (ok) {
+        ok = image_open(img, file) && img->size == (size_t)st.st_size;
+    }
+    if (!ok) {
+        image_close(img);
+        free(used);
+        return 0;
+    }
+    image_drop_holes(img);                                          // The bitmap already says which pages are erased
+    img->used = used;
+    img->used_pages = h.used_pages;
+    img->pages = h.pages;
+    *page_size = h.page_size;
+    memcpy(digest, h.digest, sizeof (h.digest));
+    return 1;
+}
+
+// Copy of a legacy backup without its spare areas, erased pages as holes
+static int cache_strip(const struct image_t *img, uint32_t page_size, const char *path)
+{
+    FILE *out = fopen(path, "wb");
+    if (!out) {
+        return 0;
+    }
+    int ok = 1;
+    for (uint32_t page = 0; page < img->pages && ok; page++) {
+        if (image_page_used(img, page)) {
+            ok = fwrite(image_page(img, page_size, page), page_size, 1, out) == 1;
+        } else {
+            ok = fseeko(out, page_size, SEEK_CUR) == 0;
+        }
+    }
+    ok = ok && fflush(out) == 0 && ftruncate(fileno(out), (off_t)img->pages * page_size) == 0;
+    return (fclose(out) == 0) && ok;
+}
+
+// Fails only if the cache is enabled but can't be written
+int cache_store(const struct image_t *img, const char *file, uint32_t page_size, uint32_t leaf, const char *digest)
+{
+    struct cache_hdr_t h;
+    struct stat st;
+    char dir[4096], path[4096 + 80], tmp[sizeof (path) + 8];
+
+    if (!cache_dir(dir, sizeof (dir)) || !*dir) {
+        return 1;
+    }
+    if (stat(file, &st) != 0 || !cache_mkdir(dir)) {
+        return 0;
+    }
+    memset(&h, 0, sizeof (h));
+    cache_identity(&h, &st);
+    h.page_size = page_size;
+    h.pages = img->pages;
+    h.used_pages = img->used_pages;
+    h.stripped = (img->spare != 0);
+    h.leaf = leaf;
+    memcpy(h.digest, digest, sizeof (h.digest));
+
+    if (h.stripped) {                                               // Written aside and renamed, a reader never sees half of it
+        snprintf(path, sizeof (path), "%s/%s.img", dir, digest);
+        snprintf(tmp, sizeof (tmp), "%s.tmp", path);
+        if (access(path, F_OK) != 0 && (!cache_strip(img, page_size, tmp) || rename(tmp, path) != 0)) {
+            unlink(tmp);
+            return 0;
+        }
+    }
+
+    if (!cache_map_path(path, sizeof (path), dir, &st)) {
+        return 0;
+    }
+    snprintf(tmp, sizeof (tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        return 0;
+    }
+    int ok = fwrite(&h, sizeof (h), 1, f) == 1
+          && fwrite(img->used, (img->pages + 7) / 8, 1, f) == 1;
+    if (fclose(f) != 0 || !ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return 0;
+    }
+    return 1;
+}
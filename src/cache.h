@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include "image.h"
+
+/*
+ * Cache of prepared images, so writing the same golden image again skips the
+ * MD5, the spare stripping and the scan for empty pages.
+ *
+ * Hashing the file is the cost being avoided, so entries are looked up by the
+ * identity of the source file (device, inode, size, modification and change
+ * times). An entry holds the verified digest, a plain MD5 (leaf 0) or an MD5
+ * tree, and the page bitmap; legacy backups also get a spare-stripped copy,
+ * stored under its digest and shared by all sources with that content.
+ * Erased pages are left out of it as holes.
+ *
+ * The cache lives in $DSOFLASH_CACHE, $XDG_CACHE_HOME/dsoflash or
+ * ~/.cache/dsoflash; an empty DSOFLASH_CACHE turns it off.
+ */
+int cache_load(struct image_t *img, const char *file, uint32_t leaf, char *digest, uint32_t *page_size);
+int cache_store(const struct image_t *img, const char *file, uint32_t page_size, uint32_t leaf, const char *digest);
+
+#endif // CACHE_H_
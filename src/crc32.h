@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#ifndef CRC32_H_
+#define CRC32_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32 as used by zlib/Ethernet (reflected 0xEDB88320), start with crc = 0
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+
+#endif // CRC32_H_
@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "daemon.h"
+
+#define DAEMON_BACKLOG  16
+
+// Listening socket at path, a stale one left by an earlier daemon is replaced
+int daemon_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof (addr.sun_path)) {
+        printf("Socket path %s is too long!\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        printf("Unable to create socket!\n");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof (addr)) != 0 || listen(fd, DAEMON_BACKLOG) != 0) {
+        printf("Unable to listen on %s!\n", path);
+        close(fd);
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);                               // A client leaving mid-job only fails its writes
+    return fd;
+}
+
+int daemon_accept(int fd, struct daemon_client_t *c)
+{
+    memset(c, 0, sizeof (*c));
+    c->fd = accept(fd, NULL, NULL);
+    if (c->fd < 0) {
+        return 0;
+    }
+    int out = dup(c->fd);                                   // Separate streams, one FILE can't both read and write a socket
+    c->in = fdopen(c->fd, "r");
+    c->out = (out >= 0) ? fdopen(out, "w") : NULL;
+    if (!c->in || !c->out) {
+        if (!c->in) {
+            close(c->fd);
+        }
+        if (out >= 0 && !c->out) {
+            close(out);
+        }
+        daemon_close(c);
+        return 0;
+    }
+    return 1;
+}
+
+void daemon_close(struct daemon_client_t *c)
+{
+    if (c->in) {
+        fclose(c->in);
+    }
+    if (c->out) {
+        fclose(c->out);
+    }
+    memset(c, 0, sizeof (*c));
+    c->fd = -1;
+}
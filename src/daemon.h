@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+#include <stdio.h>
+
+/*
+ * Daemon mode keeps every device open and set up, and takes jobs over a Unix
+ * domain socket, so a line controller can queue work without paying for USB
+ * and SDRAM setup each time.
+ *
+ * A client sends one job per line and reads the replies up to the final
+ * "ok" or "error <reason>" line before sending the next one; see usage() for
+ * the jobs and station.h for the progress and result lines in between.
+ * Clients are served one at a time, others wait in the listen queue.
+ */
+struct daemon_client_t {
+    int fd;
+    FILE *in, *out;
+};
+
+int daemon_listen(const char *path);
+int daemon_accept(int fd, struct daemon_client_t *c);
+void daemon_close(struct daemon_client_t *c);
+
+#endif // DAEMON_H_
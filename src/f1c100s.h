@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ * Copyright 2022-2024 DavidAlfa
+ */
+
+#ifndef F1C100S_H_
+#define F1C100S_H_
+
+#include <stdint.h>
+
+#define PAYLOAD_ADDR        (0x00008800UL)              // SRAM address all payloads are loaded to and run from
+
+#define SDRAM_ADDR          (0x80000000UL)              // SDRAM base address
+
+#define SDRAM_CMDBUF        (SDRAM_ADDR)                // cmd buffer address
+#define SDRAM_CMDBUF_SZ     (1024U*1024)                // cmd buffer size (1MB)
+
+#define SDRAM_DATABUF       (SDRAM_ADDR+SDRAM_CMDBUF_SZ)// data buffer address
+#define SDRAM_DATABUF_SZ    (63U*1024*1024 - 4096)      // dat buffer size(63MB), less the page for the signature
+
+#define SDRAM_SIGNATURE     (SDRAM_DATABUF+SDRAM_DATABUF_SZ)// Written after DDR init, see sdram_ready()
+#define SDRAM_SIGNATURE_0   (0x464f5344UL)              // "DSOF"
+#define SDRAM_SIGNATURE_1   (0x4d415244UL)              // "DRAM"
+
+#define SPI0_CCR            (0x01c05024UL)              // SPI0 clock rate control, set to SPI_CCR_DEFAULT by SPI_CMD_INIT
+#define SPI_CCR_DRS         (0x1000UL)                  // SCLK = AHB / (2 * (CDR2 + 1)), CDR2 in bits 7:0
+#define SPI_CCR_DEFAULT     (SPI_CCR_DRS | 1)           // AHB / 4
+
+#define SPI_CMD_CRC32       (0x09)                      // SPI payload extension, CRC-32 of a memory range (src, len, dst as LE32)
+#define SPI_CMD_PACK        (0x0a)                      // SPI payload extension, drop blank pages (addr, page_size, pages, map as LE32)
+#define SPI_CMD_RXBUF_DUAL  (0x0b)                      // SPI payload extension, SPI_CMD_RXBUF on both data lines (addr, len as LE32)
+
+struct xfel_ctx_t;
+
+uint32_t f1c100s_ahb_hz(struct xfel_ctx_t *ctx);
+uint32_t f1c100s_spi_hz(uint32_t ahb_hz, uint32_t ccr);
+uint32_t f1c100s_spi_ccr(uint32_t ahb_hz, uint32_t hz);
+
+#endif // F1C100S_H_
@@ -6,15 +6,44 @@
 
 #include <fel.h>
 
-#define SDRAM_ADDR          (0x80000000UL)              // SDRAM base address
+#include "f1c100s.h"
+#include "session.h"
+#include "usb.h"
 
-#define SDRAM_CMDBUF        (SDRAM_ADDR)                // cmd buffer address
-#define SDRAM_CMDBUF_SZ     (1024U*1024)                // cmd buffer size (1MB)
+#define PLL_CPU_CTRL        (0x01c20000UL)      // 24 MHz * N * K / (M * P)
+#define PLL_PERIPH_CTRL     (0x01c20028UL)      // 24 MHz * N * K
+#define PLL_DDR_CTRL        (0x01c20020UL)      // Bit 31: PLL enabled
+#define CPU_CLK_SRC         (0x01c20050UL)      // Bits 17:16: LOSC, OSC24M, PLL_CPU
+#define AHB_APB_CFG         (0x01c20054UL)      // Bits 13:12: LOSC, OSC24M, CPU, PLL_PERIPH / pre divider
+#define BUS_CLK_GATING0     (0x01c20060UL)      // Bit 14: SDRAM clock gated on
 
-#define SDRAM_DATABUF       (SDRAM_ADDR+SDRAM_CMDBUF_SZ)// data buffer address
-#define SDRAM_DATABUF_SZ    (63U*1024*1024)             // dat buffer size(63MB)
+static void payload_gone(struct xfel_ctx_t *ctx)
+{
+    struct session_t *s = session_get(ctx);
+    if (s) {
+        s->payload = 0;
+    }
+}
+
+// SDRAM may still be set up by an earlier run if the device stayed powered.
+// The DDR PLL and the SDRAM clock gate are off out of reset, and SDRAM is only
+// read once they are on; the signature tells our setup from anyone else's.
+static int sdram_ready(struct xfel_ctx_t *ctx)
+{
+    struct session_t *s = session_get(ctx);
 
-static uint8_t sdram_initialized;
+    if (s && s->sdram) {
+        return 1;
+    }
+    int ready = (R32(PLL_DDR_CTRL) & (1UL << 31))
+             && (R32(BUS_CLK_GATING0) & (1UL << 14))
+             && R32(SDRAM_SIGNATURE) == SDRAM_SIGNATURE_0
+             && R32(SDRAM_SIGNATURE + 4) == SDRAM_SIGNATURE_1;
+    if (s) {
+        s->sdram = ready;
+    }
+    return ready;
+}
 
 static int chip_detect(struct xfel_ctx_t *ctx, uint32_t id)
 {
@@ -81,8 +110,9 @@ static int chip_jtag(struct xfel_ctx_t *ctx)
         0xb4, 0x28, 0x93, 0xe5, 0x0f, 0x26, 0xc2, 0xe3, 0x03, 0x26, 0x82, 0xe3,
         0xb4, 0x28, 0x83, 0xe5, 0x1e, 0xff, 0x2f, 0xe1, 0x00, 0x00, 0xc2, 0x01
     };
-    fel_write(ctx, 0x00008800, (void *)&payload[0], sizeof (payload));
-    fel_exec(ctx, 0x00008800);
+    fel_write(ctx, PAYLOAD_ADDR, (void *)&payload[0], sizeof (payload));
+    payload_gone(ctx);
+    fel_exec(ctx, PAYLOAD_ADDR);
     return 1;
 }
 
@@ -428,10 +458,16 @@ static int chip_ddr(struct xfel_ctx_t *ctx, const char *type)
         0x00, 0x00, 0x60, 0x80, 0x00, 0x00, 0x20, 0x80, 0x66, 0x66, 0xe0, 0xcc,
         0xcc, 0xcc, 0x40, 0xc4
     };
-    fel_write(ctx, 0x00008800, (void *)&payload[0], sizeof (payload));
-    fel_exec(ctx, 0x00008800);
+    fel_write(ctx, PAYLOAD_ADDR, (void *)&payload[0], sizeof (payload));
+    payload_gone(ctx);
+    fel_exec(ctx, PAYLOAD_ADDR);
     usleep(100000);                                                                 // Wait 100ms for sdram init in SoC (Otherwise it might cause USB bulk error)
-    sdram_initialized = 1;
+    W32(SDRAM_SIGNATURE, SDRAM_SIGNATURE_0);                                        // Lets the next run skip all this
+    W32(SDRAM_SIGNATURE + 4, SDRAM_SIGNATURE_1);
+    struct session_t *s = session_get(ctx);
+    if (s) {
+        s->sdram = 1;
+    }
     return 1;
 }
 
@@ -495,7 +531,8 @@ static int chip_spi_init(struct xfel_ctx_t *ctx, uint32_t *swapbuf, uint32_t *sw
         0x48, 0x00, 0x00, 0x0a, 0x04, 0x00, 0x53, 0xe3, 0x4c, 0x00, 0x00, 0x0a,
         0x05, 0x00, 0x53, 0xe3, 0x51, 0x00, 0x00, 0x0a, 0x06, 0x00, 0x53, 0xe3,
         0x60, 0x00, 0x00, 0x0a, 0x07, 0x00, 0x53, 0xe3, 0x6f, 0x00, 0x00, 0x0a,
-        0x08, 0x00, 0x53, 0xe3, 0x7c, 0x00, 0x00, 0x1a, 0x0d, 0x90, 0xa0, 0xe1,
+        // 0x08, 0x00, 0x53, 0xe3, 0x7c, 0x00, 0x00, 0x1a, 0x0d, 0x90, 0xa0, 0xe1,     // Original, unknown commands end the run
+        0x08, 0x00, 0x53, 0xe3, 0x82, 0x00, 0x00, 0x1a, 0x0d, 0x90, 0xa0, 0xe1,             // Unknown commands go to the extension below first
         0x08, 0x60, 0x8d, 0xe2, 0xb0, 0x80, 0xcd, 0xe1, 0x02, 0x10, 0xa0, 0xe3,
         0x09, 0x00, 0xa0, 0xe1, 0xb0, 0xff, 0xff, 0xeb, 0x01, 0x10, 0xa0, 0xe3,
         0x06, 0x00, 0xa0, 0xe1, 0x73, 0xff, 0xff, 0xeb, 0x08, 0x30, 0xdd, 0xe5,
@@ -539,13 +576,70 @@ static int chip_spi_init(struct xfel_ctx_t *ctx, uint32_t *swapbuf, uint32_t *sw
         0x01, 0x00, 0x13, 0xe3, 0xf6, 0xff, 0xff, 0x1a, 0x04, 0x60, 0xa0, 0xe1,
         0x8f, 0xff, 0xff, 0xea, 0x14, 0xd0, 0x8d, 0xe2, 0xf0, 0x83, 0xbd, 0xe8,
         0x0f, 0xc0, 0xff, 0xff, 0x00, 0x50, 0xc0, 0x01, 0x00, 0x00, 0xc2, 0x01,
-        0x01, 0x10, 0x00, 0x00
+        0x01, 0x10, 0x00, 0x00,
+        // Extension, opcode then LE32 arguments:
+        //   SPI_CMD_CRC32 src, len, dst: builds the 0xEDB88320 table at 0x9800 (the original
+        //     SRAM cmdbuf) and stores the zlib style CRC-32 of len bytes at src into the word at dst
+        //   SPI_CMD_PACK addr, page_size, pages, map: moves the pages at addr that aren't all 0xFF
+        //     to its start, stores their count at map followed by a bitmap of which pages they were
+        //   SPI_CMD_RXBUF_DUAL addr, len: like SPI_CMD_RXBUF, but both data lines are sampled
+        //     (SPI_BCC DRM), for the x2 read from cache; nothing is sent
+        0x0b, 0x00, 0x53, 0xe3, 0x56, 0x00, 0x00, 0x0a, 0x09, 0x00, 0x53, 0xe3,
+        0x0a, 0x00, 0x53, 0x13, 0xf4, 0xff, 0xff, 0x1a, 0xa0, 0x0d, 0x2d, 0xe9,
+        0x03, 0xa0, 0xa0, 0xe1, 0x01, 0x40, 0x86, 0xe2, 0x6e, 0x00, 0x00, 0xeb,
+        0x0b, 0x00, 0xa0, 0xe1, 0x6c, 0x00, 0x00, 0xeb, 0x0b, 0x10, 0xa0, 0xe1,
+        0x6a, 0x00, 0x00, 0xeb, 0x0b, 0x20, 0xa0, 0xe1, 0x0a, 0x00, 0x5a, 0xe3,
+        0x67, 0x00, 0x00, 0x0b, 0x0b, 0x90, 0xa0, 0xe1, 0x04, 0x60, 0xa0, 0xe1,
+        0x09, 0x00, 0x5a, 0xe3, 0x19, 0x00, 0x00, 0x1a, 0xa8, 0x41, 0x9f, 0xe5,
+        0xa8, 0xc1, 0x9f, 0xe5, 0x00, 0x20, 0xa0, 0xe3, 0x02, 0x30, 0xa0, 0xe1,
+        0x08, 0xe0, 0xa0, 0xe3, 0xa3, 0x30, 0xb0, 0xe1, 0x04, 0x30, 0x23, 0x20,
+        0x01, 0xe0, 0x5e, 0xe2, 0xfb, 0xff, 0xff, 0x1a, 0x02, 0x31, 0x8c, 0xe7,
+        0x01, 0x20, 0x82, 0xe2, 0x01, 0x0c, 0x52, 0xe3, 0xf5, 0xff, 0xff, 0x1a,
+        0x00, 0x30, 0xe0, 0xe3, 0x00, 0x00, 0x51, 0xe3, 0x06, 0x00, 0x00, 0x0a,
+        0x01, 0x20, 0xd0, 0xe4, 0x03, 0x20, 0x22, 0xe0, 0xff, 0x20, 0x02, 0xe2,
+        0x02, 0x21, 0x9c, 0xe7, 0x23, 0x34, 0x22, 0xe0, 0x01, 0x10, 0x51, 0xe2,
+        0xf8, 0xff, 0xff, 0x1a, 0x03, 0x30, 0xe0, 0xe1, 0x00, 0x30, 0x89, 0xe5,
+        0x28, 0x00, 0x00, 0xea, 0x1f, 0x30, 0x82, 0xe2, 0xa3, 0x32, 0xa0, 0xe1,
+        0x04, 0xc0, 0x89, 0xe2, 0x00, 0x50, 0xa0, 0xe3, 0x01, 0x30, 0x53, 0xe2,
+        0x04, 0x50, 0x8c, 0x54, 0xfc, 0xff, 0xff, 0x5a, 0x04, 0x90, 0x89, 0xe2,
+        0x00, 0xc0, 0xa0, 0xe3, 0x00, 0xe0, 0xa0, 0xe3, 0x00, 0xa0, 0xa0, 0xe1,
+        0x02, 0x00, 0x5c, 0xe1, 0x1a, 0x00, 0x00, 0x0a, 0x00, 0x30, 0xa0, 0xe3,
+        0x03, 0x50, 0x90, 0xe7, 0x01, 0x00, 0x75, 0xe3, 0x03, 0x00, 0x00, 0x1a,
+        0x04, 0x30, 0x83, 0xe2, 0x01, 0x00, 0x53, 0xe1, 0xf9, 0xff, 0xff, 0x1a,
+        0x0f, 0x00, 0x00, 0xea, 0xac, 0x72, 0xa0, 0xe1, 0x07, 0x51, 0x99, 0xe7,
+        0x1f, 0x80, 0x0c, 0xe2, 0x01, 0xb0, 0xa0, 0xe3, 0x1b, 0x58, 0x85, 0xe1,
+        0x07, 0x51, 0x89, 0xe7, 0x01, 0xe0, 0x8e, 0xe2, 0x00, 0x00, 0x5a, 0xe1,
+        0x01, 0xa0, 0x8a, 0x00, 0x05, 0x00, 0x00, 0x0a, 0x01, 0x30, 0xa0, 0xe1,
+        0x00, 0x70, 0xa0, 0xe1, 0x30, 0x09, 0xb7, 0xe8, 0x30, 0x09, 0xaa, 0xe8,
+        0x10, 0x30, 0x53, 0xe2, 0xfb, 0xff, 0xff, 0x1a, 0x01, 0x00, 0x80, 0xe0,
+        0x01, 0xc0, 0x8c, 0xe2, 0xe2, 0xff, 0xff, 0xea, 0x04, 0xe0, 0x09, 0xe5,
+        0xa0, 0x0d, 0xbd, 0xe8, 0x11, 0xff, 0xff, 0xea, 0xa0, 0x0d, 0x2d, 0xe9,
+        0x01, 0x40, 0x86, 0xe2, 0x1b, 0x00, 0x00, 0xeb, 0x0b, 0x00, 0xa0, 0xe1,
+        0x19, 0x00, 0x00, 0xeb, 0x0b, 0x10, 0xa0, 0xe1, 0x04, 0x60, 0xa0, 0xe1,
+        0x80, 0x20, 0x9f, 0xe5, 0x01, 0x82, 0xa0, 0xe3, 0x00, 0x00, 0x51, 0xe3,
+        0xf2, 0xff, 0xff, 0x0a, 0x40, 0x00, 0x51, 0xe3, 0x40, 0x30, 0xa0, 0x23,
+        0x01, 0x30, 0xa0, 0x31, 0x30, 0x30, 0x82, 0xe5, 0x00, 0x50, 0xa0, 0xe3,
+        0x34, 0x50, 0x82, 0xe5, 0x38, 0x80, 0x82, 0xe5, 0x08, 0x50, 0x92, 0xe5,
+        0x02, 0x51, 0x85, 0xe3, 0x08, 0x50, 0x82, 0xe5, 0x1c, 0x50, 0x92, 0xe5,
+        0xff, 0x50, 0x05, 0xe2, 0x03, 0x00, 0x55, 0xe1, 0xfb, 0xff, 0xff, 0x3a,
+        0x03, 0x10, 0x41, 0xe0, 0x00, 0x53, 0xd2, 0xe5, 0x01, 0x50, 0xc0, 0xe4,
+        0x01, 0x30, 0x53, 0xe2, 0xfb, 0xff, 0xff, 0x1a, 0xe9, 0xff, 0xff, 0xea,
+        0x01, 0xb0, 0xd4, 0xe4, 0x01, 0x30, 0xd4, 0xe4, 0x03, 0xb4, 0x8b, 0xe1,
+        0x01, 0x30, 0xd4, 0xe4, 0x03, 0xb8, 0x8b, 0xe1, 0x01, 0x30, 0xd4, 0xe4,
+        0x03, 0xbc, 0x8b, 0xe1, 0x1e, 0xff, 0x2f, 0xe1, 0x20, 0x83, 0xb8, 0xed,
+        0x00, 0x98, 0x00, 0x00, 0x00, 0x50, 0xc0, 0x01
     };
-    if (!sdram_initialized) {
+    if (!sdram_ready(ctx)) {
         chip_ddr(ctx, "");                                                              // Init sdram required, the payload was modified to use buffer in SDRAM
     }
 
-    fel_write(ctx, 0x00008800, (void *)&payload[0], sizeof (payload));                      // 0x8800 is the payload address
+    struct session_t *s = session_get(ctx);
+    if (!s || !s->payload) {                                                            // Stays in SRAM until another payload replaces it
+        fel_write(ctx, PAYLOAD_ADDR, (void *)&payload[0], sizeof (payload));                // 0x8800 is the payload address
+        if (s) {
+            s->payload = 1;
+        }
+    }
 
     if (swapbuf) {
         *swapbuf = SDRAM_DATABUF;
@@ -561,9 +655,69 @@ static int chip_spi_init(struct xfel_ctx_t *ctx, uint32_t *swapbuf, uint32_t *sw
 
 static int chip_spi_run(struct xfel_ctx_t *ctx, uint8_t *cbuf, uint32_t clen)
 {
-    fel_write(ctx, SDRAM_CMDBUF, (void *)cbuf, clen);                                       // Write SPI cmd buf into SDRAM buffer
-    fel_exec(ctx, 0x00008800);                                                              // Execute SPI payload (Previously loaded to 0x8800)
-    return 1;
+    struct usb_queue q;
+    usb_queue_init(&q, ctx);
+    usb_queue_write(&q, SDRAM_CMDBUF, cbuf, clen);                                         // Write SPI cmd buf into SDRAM buffer
+    usb_queue_exec(&q, PAYLOAD_ADDR);                                                       // Execute SPI payload (Previously loaded to 0x8800)
+    int ok = usb_queue_flush(&q);
+    usb_queue_free(&q);
+    return ok;
+}
+
+static uint32_t clk_src_hz(struct xfel_ctx_t *ctx, uint32_t sel)
+{
+    uint32_t pll;
+
+    switch (sel) {
+    case 0:
+        return 32768;                                                                   // LOSC
+    case 1:
+        return 24000000;                                                                // OSC24M
+    case 2:                                                                             // PLL_CPU
+        pll = R32(PLL_CPU_CTRL);
+        return (uint32_t)(24000000ULL * (((pll >> 8) & 0x1f) + 1) * (((pll >> 4) & 3) + 1)
+                        / (((pll & 3) + 1) << ((pll >> 16) & 3)));
+    default:                                                                            // PLL_PERIPH
+        pll = R32(PLL_PERIPH_CTRL);
+        return 24000000U * (((pll >> 8) & 0x1f) + 1) * (((pll >> 4) & 3) + 1);
+    }
+}
+
+// SPI0 runs off AHB, whatever the BROM and the DDR init payload left it at
+uint32_t f1c100s_ahb_hz(struct xfel_ctx_t *ctx)
+{
+    uint32_t cfg = R32(AHB_APB_CFG), hz, sel;
+
+    switch ((cfg >> 12) & 3) {
+    case 2:                                                                             // CPU clock
+        sel = (R32(CPU_CLK_SRC) >> 16) & 3;
+        hz = clk_src_hz(ctx, (sel > 2) ? 2 : sel);
+        break;
+    case 3:
+        hz = clk_src_hz(ctx, 3) / (((cfg >> 6) & 3) + 1);
+        break;
+    default:
+        hz = clk_src_hz(ctx, (cfg >> 12) & 3);
+        break;
+    }
+    return hz >> ((cfg >> 4) & 3);
+}
+
+// Only the DRS divider is used, AHB / (2 * (CDR2 + 1))
+uint32_t f1c100s_spi_hz(uint32_t ahb_hz, uint32_t ccr)
+{
+    return ahb_hz / (2 * ((ccr & 0xff) + 1));
+}
+
+// Divider for the fastest SCLK not above hz
+uint32_t f1c100s_spi_ccr(uint32_t ahb_hz, uint32_t hz)
+{
+    uint32_t n = 0;
+
+    while (n < 0xff && f1c100s_spi_hz(ahb_hz, SPI_CCR_DRS | n) > hz) {
+        n++;
+    }
+    return SPI_CCR_DRS | n;
 }
 
 struct chip_t f1c100s_f1c200s_f1c500s = {
@@ -0,0 +1,259 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#define _GNU_SOURCE                 // SEEK_DATA, SEEK_HOLE
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "image.h"
+
+// Fallback for files that can't be mapped (pipes, some network filesystems)
+static int image_read(struct image_t *img, int fd)
+{
+    size_t cap = 0, len = 0;
+    uint8_t *buf = NULL;
+
+    for (;;) {
+        if (len == cap) {
+            uint8_t *tmp = realloc(buf, cap ? cap*2 : 64U*1024*1024);
+            if (!tmp) {
+                free(buf);
+                return 0;
+            }
+            buf = tmp;
+            cap = cap ? cap*2 : 64U*1024*1024;
+        }
+        ssize_t n = read(fd, &buf[len], cap - len);
+        if (n < 0) {
+            free(buf);
+            return 0;
+        }
+        if (n == 0) {
+            break;
+        }
+        len += n;
+    }
+    img->data = buf;
+    img->size = len;
+    img->mapped = 0;
+    return 1;
+}
+
+// Ranges the filesystem has no blocks for, see image.h
+static int image_find_holes(struct image_t *img, int fd)
+{
+#ifdef SEEK_HOLE
+    off_t data = 0, size = img->size;
+    size_t cap = 0;
+
+    while (data < size) {
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || hole >= size) {                             // Not supported, or just the implicit hole at EOF
+            break;
+        }
+        data = lseek(fd, hole, SEEK_DATA);
+        if (data < 0 || data > size) {                              // Hole runs to the end of the file
+            data = size;
+        }
+        if (img->nholes == cap) {
+            struct image_hole_t *tmp = realloc(img->holes, (cap ? cap*2 : 64) * sizeof (*tmp));
+            if (!tmp) {
+                return 0;
+            }
+            img->holes = tmp;
+            cap = cap ? cap*2 : 64;
+        }
+        img->holes[img->nholes].off = hole;
+        img->holes[img->nholes].len = data - hole;
+        img->nholes++;
+    }
+#else
+    (void)img;
+    (void)fd;
+#endif
+    return 1;
+}
+
+int image_open(struct image_t *img, const char *filename)
+{
+    struct stat st;
+    int ret = 0;
+
+    memset(img, 0, sizeof (*img));
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            madvise(p, st.st_size, MADV_SEQUENTIAL);                // Pages are consumed once, in order
+            img->data = p;
+            img->size = st.st_size;
+            img->mapped = 1;
+            ret = image_find_holes(img, fd);
+        }
+    }
+    if (!ret) {
+        image_close(img);
+        ret = image_read(img, fd);
+    }
+    close(fd);
+    return ret;
+}
+
+void image_close(struct image_t *img)
+{
+    free(img->holes);
+    free(img->used);
+    if (img->data) {
+        if (img->mapped) {
+            munmap((void *)img->data, img->size);
+        } else {
+            free((void *)img->data);
+        }
+    }
+    memset(img, 0, sizeof (*img));
+}
+
+// Holes read as zeros through the mapping, so from now on that's what they are
+void image_drop_holes(struct image_t *img)
+{
+    free(img->holes);
+    img->holes = NULL;
+    img->nholes = 0;
+}
+
+// Blocks are tested as they go, so pages with data bail out early
+int image_page_empty(const uint8_t *p, size_t len)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i ones = _mm256_set1_epi8(-1);
+    for (; i + 128 <= len; i += 128) {
+        __m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)&p[i]),      _mm256_loadu_si256((const __m256i *)&p[i + 32]));
+        __m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)&p[i + 64]), _mm256_loadu_si256((const __m256i *)&p[i + 96]));
+        if (!_mm256_testc_si256(_mm256_and_si256(a, b), ones)) {
+            return 0;
+        }
+    }
+#elif defined(__SSE2__)
+    for (; i + 64 <= len; i += 64) {
+        __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *)&p[i]),      _mm_loadu_si128((const __m128i *)&p[i + 16]));
+        __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i *)&p[i + 32]), _mm_loadu_si128((const __m128i *)&p[i + 48]));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(a, b), _mm_set1_epi8(-1))) != 0xFFFF) {
+            return 0;
+        }
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 64 <= len; i += 64) {
+        uint8x16_t a = vandq_u8(vld1q_u8(&p[i]),      vld1q_u8(&p[i + 16]));
+        uint8x16_t b = vandq_u8(vld1q_u8(&p[i + 32]), vld1q_u8(&p[i + 48]));
+        uint64x2_t v = vreinterpretq_u64_u8(vandq_u8(a, b));
+        if ((vgetq_lane_u64(v, 0) & vgetq_lane_u64(v, 1)) != UINT64_MAX) {
+            return 0;
+        }
+    }
+#endif
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, &p[i], 8);
+        if (w != UINT64_MAX) {
+            return 0;
+        }
+    }
+    for (; i < len; i++) {
+        if (p[i] != 0xFF) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Only holes covering whole pages count as erased pages, what's left of them is
+// file data reading as zeros; pages can't be told apart in old backups
+static void image_trim_holes(struct image_t *img, uint32_t page_size)
+{
+    size_t n = 0;
+
+    if (img->spare) {
+        image_drop_holes(img);
+        return;
+    }
+    for (size_t i = 0; i < img->nholes; i++) {
+        size_t start = (img->holes[i].off + page_size - 1) / page_size * page_size;
+        size_t end = (img->holes[i].off + img->holes[i].len) / page_size * page_size;
+        if (end > start) {
+            img->holes[n].off = start;
+            img->holes[n].len = end - start;
+            n++;
+        }
+    }
+    img->nholes = n;
+}
+
+// Build the bitmap of pages holding data, so batch assembly doesn't touch empty pages again
+int image_scan(struct image_t *img, uint32_t page_size, uint32_t pages)
+{
+    size_t h = 0;
+
+    free(img->used);
+    img->used_pages = 0;
+    img->pages = 0;
+    img->used = calloc((pages + 7) / 8, 1);
+    if (!img->used) {
+        return 0;
+    }
+    image_trim_holes(img, page_size);
+    for (uint32_t page = 0; page < pages; page++) {
+        size_t off = (size_t)page * page_size;
+        while (h < img->nholes && img->holes[h].off + img->holes[h].len <= off) {
+            h++;
+        }
+        if (h < img->nholes && img->holes[h].off <= off) {              // Erased page left out of a sparse file
+            continue;
+        }
+        if (!image_page_empty(image_page(img, page_size, page), page_size)) {
+            img->used[page / 8] |= 1 << (page % 8);
+            img->used_pages++;
+        }
+    }
+    img->pages = pages;
+    return 1;
+}
+
+// Length of the run at off, at most len, that is either all hole or all file data
+size_t image_extent(const struct image_t *img, size_t off, size_t len, int *hole)
+{
+    size_t lo = 0, hi = img->nholes, n;
+
+    while (lo < hi) {                                                   // First hole not ending before off
+        size_t mid = (lo + hi) / 2;
+        if (img->holes[mid].off + img->holes[mid].len <= off) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < img->nholes && img->holes[lo].off <= off) {
+        *hole = 1;
+        n = img->holes[lo].off + img->holes[lo].len - off;
+    } else {
+        *hole = 0;
+        n = (lo < img->nholes) ? img->holes[lo].off - off : len;
+    }
+    return (n < len) ? n : len;
+}
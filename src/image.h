@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Flash image mapped read-only from a file.
+ *
+ * Backups made by older versions store the spare area after every 2048 byte
+ * page; with spare set, pages are addressed with a stride of page_size+spare
+ * instead of being copied out of the file.
+ *
+ * Sparse dumps leave erased pages out as filesystem holes. Holes covering
+ * whole pages stand for 0xFF pages: image_scan() marks them unused without
+ * reading them, and image_extent() lets hashing feed 0xFF in their place
+ * instead of the zeros the mapping shows.
+ */
+struct image_hole_t {
+    size_t off, len;
+};
+
+struct image_t {
+    const uint8_t *data;
+    size_t size;            // File size
+    uint32_t spare;         // Bytes to skip after each page
+    int mapped;             // data is a mapping, not a heap buffer
+
+    struct image_hole_t *holes;
+    size_t nholes;
+
+    uint8_t *used;          // Bitmap of pages that aren't all 0xFF, see image_scan()
+    uint32_t used_pages;
+    uint32_t pages;         // Pages the bitmap covers
+};
+
+int image_open(struct image_t *img, const char *filename);
+void image_close(struct image_t *img);
+void image_drop_holes(struct image_t *img);
+int image_page_empty(const uint8_t *p, size_t len);
+int image_scan(struct image_t *img, uint32_t page_size, uint32_t pages);
+size_t image_extent(const struct image_t *img, size_t off, size_t len, int *hole);
+
+static inline const uint8_t * image_page(const struct image_t *img, uint32_t page_size, uint32_t page)
+{
+    return &img->data[(size_t)page * (page_size + img->spare)];
+}
+
+static inline int image_page_used(const struct image_t *img, uint32_t page)
+{
+    return (img->used[page / 8] >> (page % 8)) & 1;
+}
+
+#endif // IMAGE_H_
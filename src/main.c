@@ -3,37 +3,124 @@
  * Copyright 2022-2024 DavidAlfa
  */
 
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <fel.h>
 
+#include "session.h"
 #include "spinand.h"
+#include "station.h"
+#include "cache.h"
+#include "daemon.h"
 #include "md5.h"
+#include "md5tree.h"
+#include "crc32.h"
+
+#define STEPS_MAX   16
 
 
 static struct xfel_ctx_t ctx;
 static char Name[128];
 static size_t capacity;
 static uint32_t read_bytes;
-static char *flashbf, *filebf;
+static struct image_t image;
 static char filename[128];
 static char ext[16];
 static char *dot;
 static time_t start;
+static uint8_t erased[64U*1024];                        // All 0xFF, see main()
+
+// Image being loaded and hashed on its own thread while the device is brought up
+static struct {
+    char sumfile[sizeof (filename)];                    // .md5tree or .md5 file checked against
+    int checked;                                        // and whether it exists
+    uint32_t leaf;                                      // MD5 tree leaf size, 0 for a plain MD5
+    char expected[33], digest[33];
+    size_t len;                                         // Data bytes in the image, must be the flash size
+    int cached;
+    uint32_t page_size;                                 // Of the cached page bitmap
+    int failed;
+    int running;
+    pthread_t thread;
+} load;
+
+static void load_image_join(void)
+{
+    if (load.running) {
+        pthread_join(load.thread, NULL);
+        load.running = 0;
+    }
+}
 
 static int terminal_error(void)
 {
+    load_image_join();                                  // Don't unmap the image under the hashing
     if (ctx.hdl) {
         libusb_close(ctx.hdl);
     }
     libusb_exit(NULL);
-    if (flashbf) {
-        free(flashbf);
+    image_close(&image);
+    exit(-1);
+}
+
+static void md5_erased(struct UL_MD5Context *md5, size_t len)
+{
+    while (len > 0) {
+        size_t n = (len > sizeof (erased)) ? sizeof (erased) : len;
+        ul_MD5Update(md5, erased, n);
+        len -= n;
     }
-    if (filebf) {
-        free(filebf);
+}
+
+static int file_fill(FILE *out, size_t len)
+{
+    while (len > 0) {
+        size_t n = (len > sizeof (erased)) ? sizeof (erased) : len;
+        if (fwrite(erased, n, 1, out) != 1) {
+            return 0;
+        }
+        len -= n;
     }
-    exit(-1);
+    return 1;
+}
+
+struct file_sink_t {
+    FILE *out;
+    struct UL_MD5Context md5;
+    struct md5tree_t tree;
+    size_t hole_align;                                  // Filesystem block size when erased runs become holes, else 0
+};
+
+static int file_sink(void *arg, const void *data, size_t len)
+{
+    struct file_sink_t *fs = arg;
+
+    if (data) {
+        ul_MD5Update(&fs->md5, data, len);              // Hash while the next batch is being read
+        md5tree_update(&fs->tree, data, len);
+        return fwrite(data, len, 1, fs->out) == 1;
+    }
+    md5_erased(&fs->md5, len);
+    md5tree_update(&fs->tree, NULL, len);
+    if (!fs->hole_align) {
+        return file_fill(fs->out, len);
+    }
+
+    // Holes read back as zeros, so only whole filesystem blocks are skipped;
+    // erased bytes sharing a block with data are written out as usual
+    size_t a = fs->hole_align;
+    size_t head = (a - (size_t)ftello(fs->out) % a) % a;
+    if (head > len) {
+        head = len;
+    }
+    size_t skip = (len - head) / a * a;
+    return file_fill(fs->out, head)
+        && fseeko(fs->out, skip, SEEK_CUR) == 0
+        && file_fill(fs->out, len - head - skip);
 }
 
 static uint32_t file_save(const char *filename, void *buf, uint32_t len)
@@ -54,6 +141,9 @@ static void * file_load(const char *filename, uint32_t *len)
     FILE *in;
     char *buf;
     in = fopen(filename, "rb");
+    if (!in) {
+        return NULL;
+    }
 
     fseek(in, 0, SEEK_END);       // seek to end of file
     size = ftell(in);             // get current file pointer
@@ -89,37 +179,59 @@ static void usage(void)
     printf("    dsoflash detect                               - Detect flash\n");
     printf("    dsoflash status                               - Get flash status regs\n");
     printf("    dsoflash reset                                - Restart device\n");
-    printf("    dsoflash read <file>                          - Dump flash to file\n");
+    printf("    dsoflash read <file> [sparse]                 - Dump flash to file, erased pages as holes if sparse\n");
     printf("    dsoflash write <file>                         - Restore flash from file\n");
-    printf("    dsoflash erase                                - Erase flash\n\n");
+    printf("    dsoflash update <file>                        - Rewrite only blocks that differ from file\n");
+    printf("    dsoflash verify <file>                        - Compare flash with file\n");
+    printf("    dsoflash erase                                - Erase flash\n");
+    printf("    dsoflash bench [MiB]                          - Time single and dual line flash reads, 16 MiB by default\n");
+    printf("    dsoflash calibrate [MiB]                      - Find the fastest SPI clock reads hold at, over 4 MiB by default\n");
+    printf("    dsoflash <step>, <step>...                    - Run several of the above on one session, e.g.\n");
+    printf("        read old.bin, write new.bin, verify, reset  (verify without a file checks the last image)\n");
+    printf("    dsoflash station write <file>                 - Write file to every connected device at once\n");
+    printf("    dsoflash station read <file> [sparse]         - Dump every connected device to file_<usb port>\n");
+    printf("    dsoflash daemon <socket>                      - Keep every device open, take jobs on a Unix socket:\n");
+    printf("        devices | rescan | quit | write <file> | verify <file> | read <file> [sparse] | erase | reset,\n");
+    printf("        jobs on devices followed by the usb ports to run them on, all by default\n\n");
     printf("Warning: Commands will be executed inmediately, without confirmation!\n");
 }
 
 static int init_system(void)
 {
     int init = 0;
+    char path[USB_PATH_MAX];
+    int by_path = usb_port_path(libusb_get_device(ctx.hdl), path, sizeof (path));  // Come back to the same device when several are plugged in
+    struct usb_backoff wait;
 
-    printf("\nConfiguring USB to HS mode... ");
-    fel_write32(&ctx, 0x01c13040, 0x29860);
-    libusb_close(ctx.hdl);                                                  // Close USB
+    if (usb_high_speed(ctx.hdl)) {                                          // Switched by an earlier run
+        printf("\nUSB already in HS mode\n");
+        init = 1;
+    } else {
+        printf("\nConfiguring USB to HS mode... ");
+        fel_write32(&ctx, 0x01c13040, 0x29860);
+        libusb_close(ctx.hdl);                                              // Close USB
+        ctx.hdl = NULL;
+        session_end(&ctx);
 
-    for (int i = 0; i < 10; i++) {                                                // Try for 10 seconds
-        sleep(1);                                                           // Wait 1 seconds for USB reenumeration
-        ctx.hdl = libusb_open_device_with_vid_pid(NULL, 0x1f3a, 0xefe8);    // Open USB device
-        if (ctx.hdl) {                                                       // If sucessfull
-            init = fel_init(&ctx);                                          // Try initialization
-            if (init) {
-                break;
-            }                                                               // Break on success
-            libusb_close(ctx.hdl);                                          // Otherwise close handler and retry
+        usb_backoff_init(&wait);
+        while (!init && usb_backoff_wait(&wait)) {                          // Poll for the reenumeration, for 10 seconds at most
+            ctx.hdl = by_path ? usb_open_path(path) : libusb_open_device_with_vid_pid(NULL, USB_FEL_VID, USB_FEL_PID);   // Open USB device
+            if (ctx.hdl) {                                                  // If sucessfull
+                init = usb_reenumerated(ctx.hdl, &wait) && fel_init(&ctx);  // Try initialization
+                if (!init) {
+                    libusb_close(ctx.hdl);                                  // Otherwise close handler and retry
+                    ctx.hdl = NULL;
+                }
+            }
+        }
+        if (init) {
+            printf("OK\n");
         }
     }
 
     if (!init) {
         printf("ERROR: No FEL device found\n");
-        return -1;
-    } else {
-        printf("OK\n");
+        terminal_error();                                                   // Nothing left to talk to
     }
 
     if (!spinand_detect(&ctx, Name, &capacity)) {
@@ -131,20 +243,45 @@ static int init_system(void)
     return 0;
 }
 
-void compute_md5(char *data, uint32_t len, char *digest)
+void finish_md5(struct UL_MD5Context *md5_ctx, char *digest)
 {
-    struct UL_MD5Context md5_ctx;
     unsigned char d[UL_MD5LENGTH];
 
-    ul_MD5Init(&md5_ctx);
-    ul_MD5Update(&md5_ctx, (uint8_t *)data, len);
-    ul_MD5Final(d, &md5_ctx);
+    ul_MD5Final(d, md5_ctx);
     sprintf(digest, "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
             d[0],d[1],d[2],d[3],d[4],d[5],d[6],d[7],d[8],d[9],d[10],d[11],d[12],d[13],d[14],d[15]);
 
     digest[32] = 0;
 }
 
+// MD5 of the first len bytes of the image; unless raw, holes hash as the erased pages they stand for
+static void image_md5(size_t len, int raw, char *digest)
+{
+    struct UL_MD5Context md5_ctx;
+
+    ul_MD5Init(&md5_ctx);
+    for (size_t off = 0, n; off < len; off += n) {
+        int hole = 0;
+        n = raw ? len - off : image_extent(&image, off, len - off, &hole);
+        if (hole) {
+            md5_erased(&md5_ctx, n);
+        } else {
+            ul_MD5Update(&md5_ctx, &image.data[off], n);
+        }
+    }
+    finish_md5(&md5_ctx, digest);
+}
+
+// Plain MD5 of the first len bytes of the image if leaf is 0, else their MD5 tree
+static int image_digest(size_t len, int raw, uint32_t leaf, char *digest)
+{
+    if (!leaf) {
+        image_md5(len, raw, digest);
+        return 1;
+    }
+    return md5tree_image(&image, len, raw, leaf, digest);
+}
+
 void process_filename(char *s)
 {
     strcpy(filename, s);
@@ -164,143 +301,857 @@ void show_elapsed(void)
     printf("%s\n", time_str);
 }
 
-int main(int argc, char *argv[])
+// Stream the whole flash into file bin, erased runs as holes if sparse; both the MD5 and the MD5 tree are returned
+static int dump_file(struct xfel_ctx_t *c, const char *bin, int sparse, char *digest, char *tree_digest)
 {
-    if (argc < 2) {
-        usage();
+    struct file_sink_t fs = { 0 };                                  // Stream straight to the file, memory use doesn't grow with the flash size
+    struct stat st;
+
+    fs.out = fopen(bin, "wb");
+    if (!fs.out) {
+        printf("Unable to write to file %s!\n", bin);
         return 0;
     }
-    argc--;
-    argv++;
-    for (int i = 1; i < argc; i++) {
-        if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
-            usage();
+    if (sparse && fstat(fileno(fs.out), &st) == 0) {
+        fs.hole_align = st.st_blksize;
+    }
+    ul_MD5Init(&fs.md5);
+    md5tree_init(&fs.tree, MD5TREE_LEAF);
+    int ok = dso2d_dump(c, file_sink, &fs)
+          && fflush(fs.out) == 0
+          && ftruncate(fileno(fs.out), ftello(fs.out)) == 0;       // A trailing hole still has to count towards the size
+    ok = (fclose(fs.out) == 0) && ok;
+    if (!md5tree_final(&fs.tree, tree_digest)) {
+        printf("Unable to allocate MD5 tree!\n");
+        return 0;
+    }
+    if (!ok) {
+        printf("Unable to read flash into file %s!\n", bin);
+        return 0;
+    }
+    finish_md5(&fs.md5, digest);
+    return 1;
+}
+
+// Expected digest from <name>.md5tree, or else the legacy <name>.md5 whose leaf is 0;
+// filename is left naming the file used, or the .md5tree one if there is none
+static int load_checksum(char *file, uint32_t *leaf, char *digest, int *found)
+{
+    process_filename(file);
+    strcpy(dot, ".md5tree");                                // Preferred, it hashes on every core
+    char *buf = file_load(filename, &read_bytes);
+    *found = (buf != NULL);
+    if (buf) {
+        int ok = md5tree_parse(buf, read_bytes, leaf, digest);
+        free(buf);
+        if (!ok) {
+            printf("Bad MD5 tree file %s!\n", filename);
+        }
+        return ok;
+    }
+
+    strcpy(dot, ".md5");
+    buf = file_load(filename, &read_bytes);
+    *found = (buf != NULL);
+    *leaf = 0;
+    if (!buf) {
+        strcpy(dot, ".md5tree");
+        *leaf = MD5TREE_LEAF;
+        return 1;
+    }
+    memcpy(digest, buf, (read_bytes < 32) ? read_bytes : 32);
+    digest[32] = 0;
+    free(buf);
+    if (read_bytes != 33) {
+        printf("Bad MD5 filesize, must be 33 Bytes!\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Runs on the loader thread, prints nothing: the main thread is busy with the device
+static void * hash_image(void *arg)
+{
+    (void)arg;
+    load.failed = !image_digest(load.len, 0, load.leaf, load.digest);
+    if (!load.failed && load.checked && image.nholes && strcmp(load.digest, load.expected) != 0) {
+        char raw_md5[33];                                   // Maybe holes punched by a copy tool, holding zeros
+        if (image_digest(load.len, 1, load.leaf, raw_md5) && strcmp(raw_md5, load.expected) == 0) {
+            image_drop_holes(&image);
+            strcpy(load.digest, raw_md5);
+        }
+    }
+    return NULL;
+}
+
+// Map the image, or take it from the cache, and start hashing it in the background.
+// Needs no device, so it can run before the USB bring-up; load_image_check() and
+// load_image_finish() follow once the flash is known. After a failure of any of
+// them, load_image_abort() releases the image.
+static int load_image_start(char *file, int use_cache)
+{
+    memset(&load, 0, sizeof (load));
+    if (!load_checksum(file, &load.leaf, load.expected, &load.checked)) {
+        return 0;
+    }
+    strcpy(load.sumfile, filename);
+
+    load.cached = use_cache && cache_load(&image, file, load.leaf, load.digest, &load.page_size);   // Known file, skip the hashing and scanning
+    if (load.cached) {
+        load.len = (size_t)load.page_size * image.pages;
+        printf("Using cached image\n");
+        return 1;
+    }
+    if (!image_open(&image, file)) {
+        printf("Unable to read from file %s!\n", file);
+        return 0;
+    }
+
+    load.len = image.size;
+    if (image.size == ((size_t)132*1024*1024)) {                    // Data+spare of a 128 MiB flash, 64 byte spare area
+        image.spare = 64;
+    } else if (image.size == ((size_t)136*1024*1024)) {             // 128 byte spare area
+        image.spare = 128;
+    } else if (image.size == ((size_t)144*1024*1024)) {             // 256 byte spare area
+        image.spare = 256;
+    }
+    if (image.spare) {
+        load.len = (size_t)128*1024*1024;
+        printf("Old backup detected, spare area: %uBytes\n\n", image.spare);   // Skipped while writing, nothing is copied
+    }
+
+    load.running = (pthread_create(&load.thread, NULL, hash_image, NULL) == 0);
+    if (!load.running) {
+        hash_image(NULL);
+    }
+    return 1;
+}
+
+// The image must be made for the flash that was found
+static int load_image_check(char *file)
+{
+    if (load.cached && load.page_size != spinand_lookup(Name)->page_size) {   // Cached for another kind of flash
+        image_close(&image);
+        if (!load_image_start(file, 0)) {
             return 0;
         }
     }
-    libusb_init(NULL);
-    ctx.hdl = libusb_open_device_with_vid_pid(NULL, 0x1f3a, 0xefe8);
-    if (ctx.hdl == NULL) {
-        printf("ERROR: No USB device found\n");
+    if (load.len != capacity) {
+        printf("File doesn't match the flash size\n");
+        printf(" Flash: %zu Bytes,   File: %zu Bytes\n", capacity, image.size);
+        return 0;
+    }
+    return 1;
+}
+
+// Wait for the hashing, find the erased pages and check the image against its .md5tree or .md5 file
+static int load_image_finish(char *file)
+{
+    uint32_t page_size = spinand_lookup(Name)->page_size;
+    const char *kind = load.leaf ? "MD5 tree" : "MD5";
+
+    load_image_join();
+    if (load.failed) {
+        printf("Unable to allocate MD5 tree!\n");
+        return 0;
+    }
+    if (!load.cached) {
+        if (!image_scan(&image, page_size, capacity / page_size)) {
+            printf("Unable to allocate page bitmap!\n");
+            return 0;
+        }
+        if (image.nholes) {
+            printf("Sparse file, holes taken as erased pages\n");
+        }
+    }
+
+    if (!load.checked) {
+        printf("%s: %s\nFile %s not found, skipping md5 check\n", kind, load.digest, load.sumfile);
+    } else if (strcmp(load.digest, load.expected) != 0) {
+        printf("%s mismatch! Aborting...\n\n%s: %s\nComputed: %s\n\n", kind, load.sumfile, load.expected, load.digest);
+        printf("You might delete or rename the md5 file to skip md5 check\n");
+        return 0;
+    } else {
+        printf("%s OK: %s\n", kind, load.digest);
+    }
+    if (!load.cached && !cache_store(&image, file, page_size, load.leaf, load.digest)) {
+        printf("Unable to cache the image, it will be hashed again next time\n");
+    }
+    return 1;
+}
+
+static void load_image_abort(void)
+{
+    load_image_join();
+    image_close(&image);
+}
+
+// Bitmap of blocks in only (NULL for all) whose flash contents differ from the image, or NULL on error
+static uint8_t * diff_blocks(struct xfel_ctx_t *c, const uint8_t *only, uint32_t *changed)
+{
+    const struct spinand_info_t *info = spinand_lookup(Name);
+    uint32_t page_size = info->page_size, ppb = info->pages_per_block;
+    uint32_t blocks = capacity / ((size_t)page_size * ppb);
+    uint32_t *crc = malloc(blocks * sizeof (*crc));
+    uint8_t *dirty = calloc((blocks + 7) / 8, 1);
+
+    if (!image.used) {                                  // No image loaded, or closed since
+        printf("No image to check against!\n");
+        free(crc);
+        free(dirty);
+        return NULL;
+    }
+    if (!crc || !dirty) {
+        printf("Unable to allocate block digests!\n");
+        free(crc);
+        free(dirty);
+        return NULL;
+    }
+    if (!dso2d_block_crc(c, crc, blocks, only)) {
+        printf("Unable to read block digests!\n");
+        free(crc);
+        free(dirty);
+        return NULL;
+    }
+
+    uint32_t checked = 0;
+    *changed = 0;
+    for (uint32_t b = 0; b < blocks; b++) {
+        if (only && !((only[b / 8] >> (b % 8)) & 1)) {
+            continue;
+        }
+        uint32_t sum = 0;
+        for (uint32_t page = b * ppb; page < (b + 1) * ppb; page++) {
+            const uint8_t *p = image_page_used(&image, page) ? image_page(&image, page_size, page) : erased;
+            sum = crc32_update(sum, p, page_size);
+        }
+        if (sum != crc[b]) {
+            dirty[b / 8] |= 1 << (b % 8);
+            (*changed)++;
+        }
+        checked++;
+    }
+    printf("\n%u of %u blocks differ\n", *changed, checked);
+    free(crc);
+    return dirty;
+}
+
+// Check the blocks in only (NULL for all) against the image, only their CRCs cross USB
+static int verify_blocks(struct xfel_ctx_t *c, const uint8_t *only)
+{
+    uint32_t failed;
+    uint8_t *bad = diff_blocks(c, only, &failed);
+    if (!bad) {
+        return 0;
+    }
+    for (uint32_t b = 0, shown = 0; shown < failed && shown < 16; b++) {   // The first few are enough to tell
+        if ((bad[b / 8] >> (b % 8)) & 1) {
+            printf("Block %u doesn't match\n", b);
+            shown++;
+        }
+    }
+    free(bad);
+    return failed == 0;
+}
+
+struct station_dump_t {
+    const char *file;
+    int sparse;
+};
+
+// Write <name>.md5 and <name>.md5tree, name being file with its extension at suffix
+static int save_checksums(char *file, char *suffix, const char *digest, const char *tree_digest)
+{
+    char line[80];
+
+    strcpy(suffix, ".md5");
+    if (!file_save(file, (void *)digest, 33)) {
+        printf("Unable to write file %s!\n", file);
+        return 0;
+    }
+    strcpy(suffix, ".md5tree");
+    if (!md5tree_format(line, sizeof (line), MD5TREE_LEAF, tree_digest) || !file_save(file, line, strlen(line))) {
+        printf("Unable to write file %s!\n", file);
+        return 0;
+    }
+    return 1;
+}
+
+// file.bin is dumped to file_<usb port>.bin, .md5 and .md5tree, as ports tell the devices apart
+static int station_read(struct station_dev_t *d, void *arg)
+{
+    const struct station_dump_t *sd = arg;
+    const char *suffix = strrchr(sd->file, '.');
+    int base = suffix ? (int)(suffix - sd->file) : (int)strlen(sd->file);
+    char bin[sizeof (filename) + USB_PATH_MAX], sum[sizeof (bin) + 8], digest[33], tree_digest[33];
+
+    int b = snprintf(bin, sizeof (bin), "%.*s_%s%s", base, sd->file, d->path, suffix ? suffix : ".bin");
+    int n = snprintf(sum, sizeof (sum), "%.*s_%s", base, sd->file, d->path);
+    if (b < 0 || (size_t)b >= sizeof (bin) || n < 0 || (size_t)n >= sizeof (sum) - 9) {   // Room for ".md5tree"
+        printf("File name %s too long!\n", sd->file);
+        return 0;
+    }
+    if (!dump_file(&d->ctx, bin, sd->sparse, digest, tree_digest)) {
+        return 0;
+    }
+    return save_checksums(sum, &sum[n], digest, tree_digest);
+}
+
+// All workers share the one mapping of the image, read-only
+static int station_write(struct station_dev_t *d, void *arg)
+{
+    (void)arg;
+    return dso2d_restore(&d->ctx, &image, NULL, 0);
+}
+
+static int station_verify(struct station_dev_t *d, void *arg)
+{
+    (void)arg;
+    return verify_blocks(&d->ctx, NULL);
+}
+
+static int station_erase(struct station_dev_t *d, void *arg)
+{
+    (void)arg;
+    return dso2d_erase(&d->ctx, NULL);
+}
+
+// The device boots its firmware and leaves FEL, see daemon_job()
+static int station_reset(struct station_dev_t *d, void *arg)
+{
+    (void)arg;
+    return fel_chip_reset(&d->ctx);
+}
+
+// One image for all, so one kind of flash: Name and capacity are set from the
+// first device taking part, the ones with another flash are skipped and counted
+static size_t station_flash(struct station_t *st)
+{
+    struct station_dev_t *first = NULL;
+    size_t dropped = 0;
+
+    for (size_t i = 0; i < st->ndev; i++) {
+        struct station_dev_t *d = &st->dev[i];
+        if (!d->usable || d->skip) {
+            continue;
+        }
+        if (!first) {
+            first = d;
+        } else if (strcmp(d->name, first->name) != 0) {
+            printf("%s: Flash '%s' differs from '%s' on %s, skipped\n", d->path, d->name, first->name, first->path);
+            d->skip = 1;
+            dropped++;
+        }
+    }
+    if (first) {
+        strcpy(Name, first->name);
+        capacity = first->capacity;
+    }
+    return dropped;
+}
+
+static int station_main(int argc, char *argv[])
+{
+    struct station_t st;
+    struct station_dump_t sd = { argv[2], argc == 4 && !strcmp(argv[3], "sparse") };
+    int writing = (argc == 3 && !strcmp(argv[1], "write"));
+
+    if (!writing && !(!strcmp(argv[1], "read") && (argc == 3 || sd.sparse))) {
+        usage();
+        libusb_exit(NULL);
+        return 0;
+    }
+    if (strlen(argv[2]) + 16 > sizeof (filename)) {
+        printf("File name too long!\n");
         libusb_exit(NULL);
         return -1;
     }
-    if (!fel_init(&ctx)) {
-        printf("ERROR: No FEL device found\n");
+    if (writing) {
+        if (!load_image_start(argv[2], 1)) {                        // Hashed while the devices re-enumerate
+            terminal_error();
+        }
+    }
+    if (!station_open(&st)) {
+        station_close(&st);
+        load_image_join();
+        image_close(&image);
+        libusb_exit(NULL);
+        return -1;
+    }
+    size_t dropped = 0;
+    if (writing) {
+        dropped = station_flash(&st);
+        if (!load_image_check(argv[2]) || !load_image_finish(argv[2])) {
+            station_close(&st);
+            terminal_error();
+        }
+    }
+
+    start = time(0);
+    size_t failed = station_run(&st, writing ? station_write : station_read, &sd) + dropped;
+    printf("\n%zu of %zu devices %s\n", st.ndev - failed, st.ndev, writing ? "written" : "read");
+    show_elapsed();
+    station_close(&st);
+    image_close(&image);
+    libusb_exit(NULL);
+    return failed ? -1 : 0;
+}
+
+// Only the devices on the listed ports take part, all of them if there are none
+static int daemon_select(struct station_t *st, FILE *out, char **ports, int nports)
+{
+    for (size_t i = 0; i < st->ndev; i++) {
+        st->dev[i].skip = (nports > 0);
+    }
+    for (int k = 0; k < nports; k++) {
+        size_t i = 0;
+        while (i < st->ndev && strcmp(st->dev[i].path, ports[k]) != 0) {
+            i++;
+        }
+        if (i == st->ndev) {
+            fprintf(out, "error unknown device %s\n", ports[k]);
+            return 0;
+        }
+        st->dev[i].skip = 0;
+    }
+    for (size_t i = 0; i < st->ndev; i++) {
+        if (!st->dev[i].skip && st->dev[i].usable) {
+            return 1;
+        }
+    }
+    fprintf(out, "error no device\n");
+    return 0;
+}
+
+// Run one job line, replies go to out; returns 0 once the daemon is told to quit
+static int daemon_job(struct station_t *st, FILE *out, char *line)
+{
+    char *argv[4 + STATION_DEVICES_MAX], *save;
+    int argc = 0;
+
+    for (char *t = strtok_r(line, " \t\r\n", &save); t && argc < (int)ARRAY_SIZE(argv); t = strtok_r(NULL, " \t\r\n", &save)) {
+        argv[argc++] = t;
+    }
+    if (argc == 0) {
+        return 1;
+    }
+
+    const char *verb = argv[0];
+    int with_file = !strcmp(verb, "write") || !strcmp(verb, "verify") || !strcmp(verb, "read");
+    struct station_dump_t sd = { with_file && argc > 1 ? argv[1] : NULL, 0 };
+    int first_port = 1 + with_file;
+    int (*job)(struct station_dev_t *d, void *arg) = NULL;
+
+    if (!strcmp(verb, "quit")) {
+        fprintf(out, "ok\n");
+        return 0;
+    } else if (!strcmp(verb, "devices") && argc == 1) {
+        for (size_t i = 0; i < st->ndev; i++) {
+            const struct station_dev_t *d = &st->dev[i];
+            fprintf(out, "device %s %s %zu\n", d->path, d->usable ? d->name : "-", d->usable ? d->capacity/((size_t)1024*1024) : 0);
+        }
+        fprintf(out, "ok\n");
+        return 1;
+    } else if (!strcmp(verb, "rescan") && argc == 1) {               // After units were swapped
+        station_close(st);
+        station_open(st);
+        fprintf(out, "ok\n");
+        return 1;
+    } else if (with_file && !sd.file) {
+        fprintf(out, "error no file\n");
+        return 1;
+    } else if (sd.file && strlen(sd.file) + 16 > sizeof (filename)) {
+        fprintf(out, "error file name too long\n");
+        return 1;
+    }
+
+    if (!strcmp(verb, "read")) {
+        sd.sparse = (argc > 2 && !strcmp(argv[2], "sparse"));
+        first_port += sd.sparse;
+        job = station_read;
+    } else if (!strcmp(verb, "write")) {
+        job = station_write;
+    } else if (!strcmp(verb, "verify")) {
+        job = station_verify;
+    } else if (!strcmp(verb, "erase")) {
+        job = station_erase;
+    } else if (!strcmp(verb, "reset")) {
+        job = station_reset;
+    } else {
+        fprintf(out, "error unknown job %s\n", verb);
+        return 1;
+    }
+    if (!daemon_select(st, out, &argv[first_port], argc - first_port)) {
+        return 1;
+    }
+
+    int image_job = (job == station_write || job == station_verify);
+    size_t dropped = 0;
+    if (image_job) {
+        int skipped[STATION_DEVICES_MAX];
+        for (size_t i = 0; i < st->ndev; i++) {
+            skipped[i] = st->dev[i].skip;
+        }
+        dropped = station_flash(st);
+        for (size_t i = 0; i < st->ndev; i++) {
+            if (st->dev[i].skip && !skipped[i]) {                  // Another kind of flash
+                fprintf(out, "result %s failed\n", st->dev[i].path);
+            }
+        }
+        if (!load_image_start(argv[1], 1) || !load_image_check(argv[1]) || !load_image_finish(argv[1])) {
+            load_image_abort();
+            fprintf(out, "error bad image\n");
+            return 1;
+        }
+    }
+
+    st->report = out;
+    size_t failed = station_run(st, job, &sd) + dropped;
+    st->report = NULL;
+    if (image_job) {
+        image_close(&image);
+    }
+    if (job == station_reset) {                                     // Gone until the next rescan
+        for (size_t i = 0; i < st->ndev; i++) {
+            struct station_dev_t *d = &st->dev[i];
+            if (!d->skip && d->ctx.hdl) {
+                libusb_close(d->ctx.hdl);
+                d->ctx.hdl = NULL;
+                d->usable = 0;
+                session_end(&d->ctx);
+            }
+        }
+    }
+    if (failed) {
+        fprintf(out, "error %zu failed\n", failed);
+    } else {
+        fprintf(out, "ok\n");
+    }
+    return 1;
+}
+
+static int daemon_main(const char *path)
+{
+    struct station_t st;
+    struct daemon_client_t c;
+    char line[1024];
+    int run = 1;
+
+    station_open(&st);                                              // None yet is fine, rescan finds them later
+    int fd = daemon_listen(path);
+    if (fd < 0) {
+        station_close(&st);
         libusb_exit(NULL);
         return -1;
     }
-    if (!strcmp(argv[0], "ver")) {
+    printf("\nListening on %s\n", path);
+    fflush(stdout);
+
+    while (run) {
+        if (!daemon_accept(fd, &c)) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("Unable to accept connections!\n");
+            break;
+        }
+        while (run && fgets(line, sizeof (line), c.in)) {
+            if (!strchr(line, '\n') && !feof(c.in)) {
+                fprintf(c.out, "error line too long\n");
+                while (fgets(line, sizeof (line), c.in) && !strchr(line, '\n')) {}
+                fflush(c.out);
+                continue;
+            }
+            run = daemon_job(&st, c.out, line);
+            fflush(c.out);
+            fflush(stdout);
+        }
+        daemon_close(&c);
+    }
+
+    close(fd);
+    unlink(path);
+    station_close(&st);
+    libusb_exit(NULL);
+    return 0;
+}
+
+// One step of a command line such as "read old.bin, write new.bin, verify, reset"
+struct step_t {
+    int argc;
+    char *argv[3];
+};
+
+static char loaded[sizeof (filename)];                  // File whose checked image an earlier step left in image
+static int ready;                                       // USB in HS mode and flash detected
+static int blank;                                       // Flash erased by the previous step
+
+static int step_file(const char *file)
+{
+    return strlen(file) + 16 <= sizeof (filename);      // Room for the .md5tree next to it
+}
+
+// verify may leave out the file after a step that loaded one, as long as no read
+// overwrote it since; reset ends the device's FEL session
+static int step_valid(const struct step_t *s, const char **image_file, int last)
+{
+    const char *verb = s->argv[0];
+
+    if (s->argc == 1 && (!strcmp(verb, "ver") || !strcmp(verb, "detect") || !strcmp(verb, "status") || !strcmp(verb, "erase"))) {
+        return 1;
+    } else if (s->argc == 1 && !strcmp(verb, "reset")) {
+        return last;
+    } else if (!strcmp(verb, "read")) {
+        if (*image_file && !strcmp(*image_file, s->argv[1])) {
+            *image_file = NULL;
+        }
+        return (s->argc == 2 || (s->argc == 3 && !strcmp(s->argv[2], "sparse"))) && step_file(s->argv[1]);
+    } else if (s->argc == 2 && (!strcmp(verb, "write") || !strcmp(verb, "update") || !strcmp(verb, "verify"))) {
+        *image_file = s->argv[1];
+        return step_file(s->argv[1]);
+    } else if (s->argc == 1 && !strcmp(verb, "verify")) {
+        return *image_file != NULL;
+    } else if (!strcmp(verb, "bench") || !strcmp(verb, "calibrate")) {
+        char *end;
+        return s->argc == 1 || (s->argc == 2 && strtoul(s->argv[1], &end, 10) > 0 && !*end);
+    }
+    return 0;
+}
+
+// Steps are separated by commas ending a word, or standing alone; 0 if any is malformed
+static int split_steps(int argc, char *argv[], struct step_t *steps, int max)
+{
+    struct step_t *s = NULL;
+    const char *image_file = NULL;
+    int n = 0;
+
+    for (int i = 0; i < argc; i++) {
+        size_t len = strlen(argv[i]);
+        int end = (len > 0 && argv[i][len - 1] == ',');
+        if (end) {
+            argv[i][--len] = 0;
+            if (len > 0 && argv[i][len - 1] == ',') {   // Empty step
+                return 0;
+            }
+        }
+        if (len > 0) {
+            if (!s) {
+                if (n == max) {
+                    return 0;
+                }
+                s = &steps[n++];
+                s->argc = 0;
+            }
+            if (s->argc == (int)ARRAY_SIZE(s->argv)) {
+                return 0;
+            }
+            s->argv[s->argc++] = argv[i];
+        }
+        if (end) {
+            if (!s) {                                   // Empty step
+                return 0;
+            }
+            s = NULL;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (!step_valid(&steps[i], &image_file, i == n - 1)) {
+            return 0;
+        }
+    }
+    return n;
+}
+
+static void system_ready(void)
+{
+    if (!ready) {
+        init_system();
+        ready = 1;
+    }
+}
+
+// Take the image of file, unless an earlier step left it loaded, erasing the
+// flash meanwhile if asked to; hashing runs through the USB bring-up and the erase
+static void use_image(char *file, int erase)
+{
+    int fresh = strcmp(file, loaded) != 0;
+
+    if (!*file) {                                       // verify without a file after a read replaced the image
+        printf("No image to check against!\n");
+        terminal_error();
+    }
+    if (fresh) {
+        loaded[0] = 0;
+        image_close(&image);
+        if (!load_image_start(file, 1)) {
+            terminal_error();
+        }
+    }
+    system_ready();
+    if (fresh && !load_image_check(file)) {
+        terminal_error();
+    }
+    if (erase) {
+        start = time(0);
+        if (!blank && !dso2d_erase(&ctx, NULL)) {       // Not again right after an erase step
+            terminal_error();
+        }
+    }
+    if (fresh) {
+        if (!load_image_finish(file)) {                 // Nothing is programmed unless the image checks out
+            terminal_error();
+        }
+        strcpy(loaded, file);
+    }
+}
+
+// Any failure ends the whole run through terminal_error()
+static void run_step(const struct step_t *s)
+{
+    const char *verb = s->argv[0];
+    char *file = (s->argc > 1) ? s->argv[1] : loaded;
+
+    if (!strcmp(verb, "ver")) {
         printf("%.8s ID=0x%08x(%s) dflag=0x%02x dlength=0x%02x scratchpad=0x%08x\n",
                ctx.version.magic, ctx.version.id, ctx.chip->name, ctx.version.dflag,
                ctx.version.dlength, ctx.version.scratchpad);
-    } else if (!strcmp(argv[0], "detect") && (argc == 1)) {
+    } else if (!strcmp(verb, "detect")) {
         init_system();
-    } else if (!strcmp(argv[0], "status") && (argc == 1)) {
+        ready = 1;
+    } else if (!strcmp(verb, "status")) {
         dso2d_dump_regs(&ctx);
-    } else if (!strcmp(argv[0], "reset")) {
+    } else if (!strcmp(verb, "reset")) {
         fel_chip_reset(&ctx);
-    } else if (!strcmp(argv[0], "erase") && (argc == 1)) {
-        dso2d_erase(&ctx);
-    } else if (!strcmp(argv[0], "read") && (argc == 2)) {
-        init_system();
-        process_filename(argv[1]);
-        flashbf = malloc(capacity);
-        if (!flashbf) {
-            printf("Unable to allocate flash buffer!\n");
+    } else if (!strcmp(verb, "erase")) {
+        if (!dso2d_erase(&ctx, NULL)) {
+            terminal_error();
+        }
+        blank = 1;
+    } else if (!strcmp(verb, "bench")) {
+        system_ready();
+        if (!dso2d_bench(&ctx, (s->argc > 1) ? strtoul(s->argv[1], NULL, 10) : 16)) {
             terminal_error();
         }
+    } else if (!strcmp(verb, "calibrate")) {
+        system_ready();
+        if (!dso2d_calibrate(&ctx, (s->argc > 1) ? strtoul(s->argv[1], NULL, 10) : 4)) {
+            terminal_error();
+        }
+    } else if (!strcmp(verb, "read")) {
+        system_ready();
+        if (!strcmp(file, loaded)) {                    // Rewritten under the mapping
+            loaded[0] = 0;
+            image_close(&image);
+        }
+        process_filename(file);
+        char data_md5[33], tree_md5[33];
         start = time(0);
-        dso2d_dump(&ctx, flashbf);
-        if (!file_save(filename, flashbf, capacity)) {
-            printf("Unable to write to file %s!\n", filename);
+        if (!dump_file(&ctx, filename, s->argc == 3, data_md5, tree_md5)) {
             terminal_error();
-        } else {
-            char data_md5[33];
-            printf("\nFlash saved to %s\n", filename);
-            strcpy(dot, ".md5");
-            compute_md5(flashbf, capacity, data_md5);
-            if (!file_save(filename, data_md5, sizeof (data_md5))) {
-                printf("Unable to write file %s!\n\nMD5: %s\n", filename, data_md5);
-            } else {
-                printf("%s\n\nMD5: %s\n", filename, data_md5);
-            }
-            show_elapsed();
-            free(flashbf);
         }
-    } else if (!strcmp(argv[0], "write") && (argc == 2)) {
-        init_system();
-
-        char data_md5[33];
-        process_filename(argv[1]);
-        strcpy(dot, ".md5");
-        char *file_md5 = file_load(filename, &read_bytes);
-        if (file_md5 != NULL && read_bytes != 33) {
-            printf("Bad MD5 filesize, must be 33 Bytes!\n");
+        printf("\nFlash saved to %s\n", filename);
+        if (save_checksums(filename, dot, data_md5, tree_md5)) {
+            printf("%.*s.md5, .md5tree\n", (int)(dot - filename), filename);
+        }
+        printf("\nMD5: %s\nMD5 tree: %s\n", data_md5, tree_md5);
+        show_elapsed();
+    } else if (!strcmp(verb, "write")) {
+        use_image(file, 1);
+        blank = 0;
+        if (!dso2d_restore(&ctx, &image, NULL, 1)) {
+            printf("\nWrite failed!\n");
             terminal_error();
         }
+        printf("\nFlash written sucessfully from file %s\n", file);
+        show_elapsed();
+    } else if (!strcmp(verb, "update")) {
+        use_image(file, 0);
 
-        filebf = file_load(argv[1], &read_bytes);
-        if (!filebf) {
-            printf("Unable to read from file %s!\n", argv[1]);
+        uint32_t changed;
+        start = time(0);
+        uint8_t *dirty = diff_blocks(&ctx, NULL, &changed);
+        if (!dirty) {
             terminal_error();
         }
-
-        compute_md5(filebf, capacity, data_md5);
-
-        if (read_bytes != capacity) {                          // capacity not matching flash size
-            size_t spare;                             // Check  if filesize matches data+spare
-            if (read_bytes == ((size_t)132*1024*1024)) {                // 64 byte spare area
-                spare = 64;
-            } else if (read_bytes == ((size_t)136*1024*1024)) {      // 128 byte spare area
-                spare = 128;
-            } else if (read_bytes == ((size_t)144*1024*1024)) {      // 256 byte spare area
-                spare = 256;
-            } else {
-                printf("File doesn't match the flash size\n");
-                printf(" Flash: %zu Bytes,   File: %zu Bytes\n", read_bytes, capacity);
+        if (changed) {
+            blank = 0;
+            if (!dso2d_restore(&ctx, &image, dirty, 0)) {
+                printf("\nWrite failed!\n");
+                free(dirty);
                 terminal_error();
             }
-
-            printf("Old backup detected, spare area: %zuBytes\n\n", spare);
-
-            char *tmp = malloc(read_bytes);                       // Temporal buffer
-            if (tmp == NULL) {
-                printf("Unable to allocate flash buffer!\n");
+            if (!verify_blocks(&ctx, dirty)) {                            // Rewritten blocks only
+                printf("\nVerification failed!\n");
+                free(dirty);
                 terminal_error();
             }
-            char *in = filebf, *out = tmp;
-            for (size_t i = 0; i < read_bytes; i += (2048+spare)) {        // Extract data
-                memcpy(out, in, 2048);
-                in += 2048+spare;
-                out += 2048;
-            }
-            memcpy(filebf,tmp,capacity);                        // Copy data
-            free(tmp);
-        }
-
-        if (!file_md5) {
-            printf("MD5: %s\nFile %s not found, skipping md5 check\n", data_md5, filename);
-        } else if (strcmp(data_md5, file_md5) != 0) {
-            printf("MD5 mismatch! Aborting...\n\n%s: %s\nComputed: %s\n\n", filename, file_md5, data_md5);
-            printf("You might delete or rename the md5 file to skip md5 check\n");
-            terminal_error();
+            printf("\nFlash updated sucessfully from file %s\n", file);
         } else {
-            printf("MD5 OK: %s\n", data_md5);
-        }
-        if (file_md5) {
-            free(file_md5);
+            printf("\nFlash already matches file %s\n", file);
         }
+        show_elapsed();
+        free(dirty);
+    } else if (!strcmp(verb, "verify")) {
+        use_image(file, 0);
 
         start = time(0);
-        dso2d_restore(&ctx, filebf);
-        printf("\nFlash written sucessfully from file %s\n", argv[1]);
+        if (!verify_blocks(&ctx, NULL)) {
+            printf("\nFlash doesn't match file %s!\n", file);
+            terminal_error();
+        }
+        printf("\nFlash matches file %s\n", file);
         show_elapsed();
-        free(filebf);
-    } else {
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
         usage();
+        return 0;
+    }
+    argc--;
+    argv++;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+            usage();
+            return 0;
+        }
+    }
+    memset(erased, 0xFF, sizeof (erased));
+    libusb_init(NULL);
+    if (!strcmp(argv[0], "station") && argc >= 3) {                // Opens every device itself
+        return station_main(argc, argv);
+    }
+    if (!strcmp(argv[0], "daemon") && argc == 2) {                 // So does this
+        return daemon_main(argv[1]);
+    }
+    struct step_t steps[STEPS_MAX];
+    int nsteps = split_steps(argc, argv, steps, STEPS_MAX);
+    if (!nsteps) {
+        usage();
+        libusb_exit(NULL);
+        return 0;
+    }
+    ctx.hdl = libusb_open_device_with_vid_pid(NULL, USB_FEL_VID, USB_FEL_PID);
+    if (ctx.hdl == NULL) {
+        printf("ERROR: No USB device found\n");
+        libusb_exit(NULL);
+        return -1;
+    }
+    if (!fel_init(&ctx)) {
+        printf("ERROR: No FEL device found\n");
+        libusb_exit(NULL);
+        return -1;
+    }
+    for (int i = 0; i < nsteps; i++) {
+        if (nsteps > 1) {
+            printf("\n== Step %d of %d: %s%s%s\n", i + 1, nsteps, steps[i].argv[0], (steps[i].argc > 1) ? " " : "", (steps[i].argc > 1) ? steps[i].argv[1] : "");
+        }
+        run_step(&steps[i]);
     }
 
+    image_close(&image);
     libusb_close(ctx.hdl);
     libusb_exit(NULL);
     return 0;
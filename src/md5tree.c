@@ -0,0 +1,235 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "md5tree.h"
+
+#define MD5TREE_THREADS_MAX 64
+
+static uint8_t ff[64U*1024];
+static pthread_once_t ff_once = PTHREAD_ONCE_INIT;
+
+static void ff_init(void)
+{
+    memset(ff, 0xFF, sizeof (ff));
+}
+
+static void md5_ff(struct UL_MD5Context *md5, size_t len)
+{
+    pthread_once(&ff_once, ff_init);
+    while (len > 0) {
+        size_t n = (len > sizeof (ff)) ? sizeof (ff) : len;
+        ul_MD5Update(md5, ff, n);
+        len -= n;
+    }
+}
+
+static void md5_hex(char *out, const uint8_t *d)
+{
+    for (int i = 0; i < UL_MD5LENGTH; i++) {
+        sprintf(&out[2*i], "%02x", d[i]);
+    }
+    out[32] = 0;
+}
+
+static void erased_leaf(uint32_t leaf, uint8_t *digest)
+{
+    struct UL_MD5Context md5;
+    ul_MD5Init(&md5);
+    md5_ff(&md5, leaf);
+    ul_MD5Final(digest, &md5);
+}
+
+static uint8_t * leaf_slot(struct md5tree_t *t)
+{
+    if (t->n == t->cap) {
+        size_t cap = t->cap ? t->cap*2 : 256;
+        uint8_t *d = realloc(t->digests, cap * UL_MD5LENGTH);
+        if (!d) {
+            t->failed = 1;
+            return NULL;
+        }
+        t->digests = d;
+        t->cap = cap;
+    }
+    return &t->digests[UL_MD5LENGTH * t->n++];
+}
+
+void md5tree_init(struct md5tree_t *t, uint32_t leaf)
+{
+    memset(t, 0, sizeof (*t));
+    t->leaf = leaf;
+    ul_MD5Init(&t->md5);
+    erased_leaf(leaf, t->erased);
+}
+
+// NULL data stands for len bytes of erased flash, whole erased leaves cost nothing
+void md5tree_update(struct md5tree_t *t, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    while (len > 0) {
+        uint32_t n = t->leaf - t->fill;
+        if (n > len) {
+            n = len;
+        }
+        uint8_t *d;
+        if (!p && t->fill == 0 && n == t->leaf) {
+            if ((d = leaf_slot(t))) {
+                memcpy(d, t->erased, UL_MD5LENGTH);
+            }
+        } else {
+            if (p) {
+                ul_MD5Update(&t->md5, p, n);
+            } else {
+                md5_ff(&t->md5, n);
+            }
+            t->fill += n;
+            if (t->fill == t->leaf) {
+                if ((d = leaf_slot(t))) {
+                    ul_MD5Final(d, &t->md5);
+                }
+                ul_MD5Init(&t->md5);
+                t->fill = 0;
+            }
+        }
+        p = p ? p + n : NULL;
+        len -= n;
+    }
+}
+
+static void md5tree_root(const uint8_t *digests, size_t n, char *digest)
+{
+    struct UL_MD5Context md5;
+    uint8_t d[UL_MD5LENGTH];
+
+    ul_MD5Init(&md5);
+    ul_MD5Update(&md5, digests, n * UL_MD5LENGTH);
+    ul_MD5Final(d, &md5);
+    md5_hex(digest, d);
+}
+
+int md5tree_final(struct md5tree_t *t, char *digest)
+{
+    uint8_t *d;
+
+    if (t->fill && (d = leaf_slot(t))) {
+        ul_MD5Final(d, &t->md5);
+    }
+    if (!t->failed) {
+        md5tree_root(t->digests, t->n, digest);
+    }
+    free(t->digests);
+    t->digests = NULL;
+    return !t->failed;
+}
+
+struct tree_part_t {
+    const struct image_t *img;
+    size_t len;                             // Bytes of the image covered by the tree
+    int raw;
+    uint32_t leaf;
+    const uint8_t *erased;
+    uint8_t *digests;
+    size_t first, last;                     // Leaves of this part
+    pthread_t thread;
+};
+
+// Unless raw, holes hash as the erased pages they stand for
+static void * tree_part(void *arg)
+{
+    struct tree_part_t *tp = arg;
+
+    for (size_t i = tp->first; i < tp->last; i++) {
+        size_t off = i * tp->leaf, end = off + tp->leaf, n;
+        uint8_t *out = &tp->digests[UL_MD5LENGTH * i];
+        struct UL_MD5Context md5;
+        int hole = 0;
+
+        if (end > tp->len) {
+            end = tp->len;
+        }
+        if (!tp->raw && image_extent(tp->img, off, end - off, &hole) == tp->leaf && hole) {
+            memcpy(out, tp->erased, UL_MD5LENGTH);                  // Whole leaf erased, digest known
+            continue;
+        }
+        ul_MD5Init(&md5);
+        for (size_t pos = off; pos < end; pos += n) {
+            n = tp->raw ? end - pos : image_extent(tp->img, pos, end - pos, &hole);
+            if (hole) {
+                md5_ff(&md5, n);
+            } else {
+                ul_MD5Update(&md5, &tp->img->data[pos], n);
+            }
+        }
+        ul_MD5Final(out, &md5);
+    }
+    return NULL;
+}
+
+// Tree digest of the first len bytes of img, leaves split evenly over the cores
+int md5tree_image(const struct image_t *img, size_t len, int raw, uint32_t leaf, char *digest)
+{
+    struct tree_part_t part[MD5TREE_THREADS_MAX];
+    size_t leaves = (len + leaf - 1) / leaf;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nparts = (cpus < 1) ? 1 : (cpus > MD5TREE_THREADS_MAX) ? MD5TREE_THREADS_MAX : (size_t)cpus;
+    uint8_t erased[UL_MD5LENGTH];
+    uint8_t *digests = malloc(leaves * UL_MD5LENGTH + 1);
+
+    if (!digests) {
+        return 0;
+    }
+    if (nparts > leaves) {
+        nparts = leaves ? leaves : 1;
+    }
+    erased_leaf(leaf, erased);
+    for (size_t i = 0; i < nparts; i++) {
+        part[i] = (struct tree_part_t){ img, len, raw, leaf, erased, digests, leaves * i / nparts, leaves * (i + 1) / nparts, 0 };
+    }
+
+    int started[MD5TREE_THREADS_MAX] = { 0 };
+    for (size_t i = 1; i < nparts; i++) {                           // The calling thread takes part 0
+        started[i] = (pthread_create(&part[i].thread, NULL, tree_part, &part[i]) == 0);
+    }
+    tree_part(&part[0]);
+    for (size_t i = 1; i < nparts; i++) {
+        if (started[i]) {
+            pthread_join(part[i].thread, NULL);
+        } else {
+            tree_part(&part[i]);
+        }
+    }
+
+    md5tree_root(digests, leaves, digest);
+    free(digests);
+    return 1;
+}
+
+int md5tree_format(char *buf, size_t len, uint32_t leaf, const char *digest)
+{
+    int n = snprintf(buf, len, "md5tree:%u:%s\n", leaf, digest);
+    return n > 0 && (size_t)n < len;
+}
+
+int md5tree_parse(const char *buf, size_t len, uint32_t *leaf, char *digest)
+{
+    char line[80];
+    int end = 0;
+
+    if (len >= sizeof (line)) {
+        return 0;
+    }
+    memcpy(line, buf, len);
+    line[len] = 0;
+    if (sscanf(line, "md5tree:%u:%32[0-9a-f]%n", leaf, digest, &end) != 2 || strlen(digest) != 32) {
+        return 0;
+    }
+    return *leaf >= 4096 && strspn(&line[end], "\r\n") == len - end;               // Nothing but the line end after it
+}
@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#ifndef MD5TREE_H_
+#define MD5TREE_H_
+
+#include "image.h"
+#include "md5.h"
+
+#define MD5TREE_LEAF    (1024U*1024)        // Leaf size of the trees dsoflash writes
+
+/*
+ * Two level MD5 tree: every leaf (a fixed size chunk, the last one possibly
+ * shorter) is hashed on its own, the root is the MD5 of the leaf digests in
+ * order. Leaves are independent, so an image is hashed on all cores instead
+ * of in a single pass, and a leaf of erased flash always has the same digest.
+ *
+ * Stored next to an image as <name>.md5tree, one line: "md5tree:<leaf>:<root>".
+ */
+struct md5tree_t {
+    uint32_t leaf;
+    uint8_t erased[UL_MD5LENGTH];           // Digest of a leaf of 0xFF
+    struct UL_MD5Context md5;               // Leaf being filled
+    uint32_t fill;
+    uint8_t *digests;                       // Finished leaves
+    size_t n, cap;
+    int failed;
+};
+
+void md5tree_init(struct md5tree_t *t, uint32_t leaf);
+void md5tree_update(struct md5tree_t *t, const void *data, size_t len);
+int md5tree_final(struct md5tree_t *t, char *digest);
+
+int md5tree_image(const struct image_t *img, size_t len, int raw, uint32_t leaf, char *digest);
+
+int md5tree_format(char *buf, size_t len, uint32_t leaf, const char *digest);
+int md5tree_parse(const char *buf, size_t len, uint32_t *leaf, char *digest);
+
+#endif // MD5TREE_H_
@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipeline.h"
+
+/*
+ * Slot k is free for the first stage once the second stage has finished
+ * slot k - PIPELINE_SLOTS, and ready for the second stage once the first
+ * stage has finished slot k.
+ */
+
+static void * pipeline_thread(void *arg)
+{
+    struct pipeline *p = arg;
+
+    for (uint32_t k = 0; ; k++) {
+        pthread_mutex_lock(&p->lock);
+        if (p->worker_first) {
+            while (k >= p->second_done + PIPELINE_SLOTS && !p->closing) {
+                pthread_cond_wait(&p->cond, &p->lock);
+            }
+        } else {
+            while (k >= p->first_done && !p->closing) {
+                pthread_cond_wait(&p->cond, &p->lock);
+            }
+        }
+        if (p->closing && (p->worker_first || k >= p->first_done)) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        int r = p->work(p->arg, &p->slot[k % PIPELINE_SLOTS]);
+
+        pthread_mutex_lock(&p->lock);
+        if (r > 0) {
+            if (p->worker_first) {
+                p->first_done++;
+            } else {
+                p->second_done++;
+            }
+        }
+        p->failed |= (r < 0);
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        if (r <= 0) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->finished = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+int pipeline_start(struct pipeline *p, size_t size, int worker_first, int (*work)(void *arg, struct pipeline_slot *s), void *arg)
+{
+    memset(p, 0, sizeof (*p));
+    p->worker_first = worker_first;
+    p->work = work;
+    p->arg = arg;
+
+    for (size_t i = 0; i < PIPELINE_SLOTS; i++) {
+        if (size && !(p->slot[i].buf = malloc(size))) {
+            goto FAIL;
+        }
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    if (pthread_create(&p->thread, NULL, pipeline_thread, p) != 0) {
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->cond);
+        goto FAIL;
+    }
+    return 1;
+
+FAIL:
+    for (size_t i = 0; i < PIPELINE_SLOTS; i++) {
+        free(p->slot[i].buf);
+    }
+    return 0;
+}
+
+struct pipeline_slot * pipeline_next(struct pipeline *p)
+{
+    struct pipeline_slot *s = NULL;
+    uint32_t k = p->caller_seq;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->worker_first) {
+        while (k >= p->first_done && !p->finished) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if (k < p->first_done && !p->failed) {
+            s = &p->slot[k % PIPELINE_SLOTS];
+        }
+    } else {
+        while (k >= p->second_done + PIPELINE_SLOTS && !p->finished) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if (!p->failed && !p->finished) {
+            s = &p->slot[k % PIPELINE_SLOTS];
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return s;
+}
+
+void pipeline_done(struct pipeline *p, struct pipeline_slot *s)
+{
+    (void)s;
+    pthread_mutex_lock(&p->lock);
+    p->caller_seq++;
+    if (p->worker_first) {
+        p->second_done++;
+    } else {
+        p->first_done++;
+    }
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+int pipeline_stop(struct pipeline *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->closing = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    pthread_join(p->thread, NULL);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    for (size_t i = 0; i < PIPELINE_SLOTS; i++) {
+        free(p->slot[i].buf);
+    }
+    return !p->failed;
+}
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PIPELINE_SLOTS 2
+
+struct pipeline_slot {
+    uint8_t *buf;
+    size_t len;
+    uint32_t page;          // First flash page the slot refers to
+    uint32_t pages;
+    void *priv;             // Per-slot data of the pipeline user
+};
+
+/*
+ * Two stage pipeline between the calling thread and one worker thread,
+ * handing PIPELINE_SLOTS buffers back and forth in order.
+ *
+ * With worker_first == 0 the caller fills slots and the worker drains them
+ * until pipeline_stop(). Otherwise the worker fills slots and the caller
+ * drains them; the worker's work() returns 0 after the last slot.
+ * work() returns -1 to abort the pipeline.
+ */
+struct pipeline {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct pipeline_slot slot[PIPELINE_SLOTS];
+    uint32_t first_done, second_done;
+    uint32_t caller_seq;
+    int worker_first;
+    int closing, finished, failed;
+    int (*work)(void *arg, struct pipeline_slot *s);
+    void *arg;
+};
+
+int pipeline_start(struct pipeline *p, size_t size, int worker_first, int (*work)(void *arg, struct pipeline_slot *s), void *arg);
+struct pipeline_slot * pipeline_next(struct pipeline *p);
+void pipeline_done(struct pipeline *p, struct pipeline_slot *s);
+int pipeline_stop(struct pipeline *p);
+
+#endif // PIPELINE_H_
@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "session.h"
+
+#define SESSIONS_MAX    16                  // Station mode drives several devices
+
+static struct session_t sessions[SESSIONS_MAX];
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Only the thread driving ctx touches its entry, the lock guards the table itself
+struct session_t * session_get(struct xfel_ctx_t *ctx)
+{
+    struct session_t *s = NULL;
+
+    pthread_mutex_lock(&sessions_lock);
+    for (size_t i = 0; i < SESSIONS_MAX && !s; i++) {
+        if (sessions[i].ctx == ctx) {
+            s = &sessions[i];
+        }
+    }
+    for (size_t i = 0; i < SESSIONS_MAX && !s; i++) {
+        if (!sessions[i].ctx) {
+            s = &sessions[i];
+            memset(s, 0, sizeof (*s));
+            s->ctx = ctx;
+        }
+    }
+    pthread_mutex_unlock(&sessions_lock);
+    return s;
+}
+
+void session_end(struct xfel_ctx_t *ctx)
+{
+    pthread_mutex_lock(&sessions_lock);
+    for (size_t i = 0; i < SESSIONS_MAX; i++) {
+        if (sessions[i].ctx == ctx) {
+            memset(&sessions[i], 0, sizeof (sessions[i]));
+        }
+    }
+    pthread_mutex_unlock(&sessions_lock);
+}
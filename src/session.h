@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include <fel.h>
+
+#include "spinand.h"
+
+/*
+ * What is already set up on a device, so operations after the first one
+ * don't start over: SDRAM, the SPI payload in SRAM and the flash itself
+ * (identified, reset, ECC on, protection cleared). Kept per xfel context,
+ * for as long as it talks to the same device; session_end() forgets it.
+ *
+ * SDRAM survives between runs while the device stays powered, see
+ * sdram_ready() in f1c100s_f1c200s_f1c500s.c.
+ */
+struct session_t {
+    struct xfel_ctx_t *ctx;
+    int sdram;
+    int payload;                            // SPI payload loaded at PAYLOAD_ADDR
+    int flash;                              // Flash identified and reset, info is valid
+    int unlocked;                           // Block protection cleared
+    uint32_t spi_ccr;                       // SPI clock from a calibration or DSOFLASH_SPI_CLOCK, 0 for the payload's
+    int spi_dual;                           // bench read the same on one and on two lines
+    struct spinand_info_t info;
+};
+
+// NULL when too many devices are open, the caller then sets everything up each time
+struct session_t * session_get(struct xfel_ctx_t *ctx);
+void session_end(struct xfel_ctx_t *ctx);
+
+#endif // SESSION_H_
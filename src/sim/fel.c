@@ -0,0 +1,634 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+/*
+ * Software stand-in for a F1C100s in FEL mode with a SPI NAND attached.
+ *
+ * Replaces xfel's fel.c and the few libusb calls dsoflash makes (usb.c adds the
+ * asynchronous transfer API on top of a FEL protocol decoder), so the whole
+ * dsoflash flow can run on a build box. fel_exec() of the SPI payload
+ * interprets the command buffer in SDRAM against the NAND model in nand.c;
+ * every USB transfer, SPI byte and busy period advances a modeled clock that
+ * is reported on libusb_exit().
+ *
+ * Environment:
+ *   DSOFLASH_SIM_CHIP      chip name from spinand_infos (default W25N01GV)
+ *   DSOFLASH_SIM_FLASH     file backing the flash data area, created blank if missing
+ *   DSOFLASH_SIM_TIMING    comma separated overrides, e.g. "tR=25,tPROG=300,usb=20"
+ *                          usb, usb_fs, cpu [MB/s]  req, dev, exec, tR, tPROG, tBERS [us]  spi_max [MHz]
+ *   DSOFLASH_SIM_REALTIME  if set, sleep for the modeled time as it passes
+ *   DSOFLASH_SIM_DEVICES   number of devices on the bus (default 1), found at ports 1-1, 1-2...;
+ *                          each has its own clock, device N > 0 is backed by DSOFLASH_SIM_FLASH.N
+ *   DSOFLASH_SIM_HS        if set, devices start as an earlier run left them: HS mode, SDRAM set up
+ */
+
+#include "sim.h"
+#include "../crc32.h"
+#include "../f1c100s.h"
+
+#define SRAM_SZ         (64U*1024)
+#define SDRAM_SZ        (64U*1024*1024)
+#define FEL_CHUNK       (64U*1024)                                  // xfel splits reads and writes into 64 KiB requests
+
+#define SPI0_BASE       (0x01c05000UL)                              // Literal only found in the SPI payload
+#define DRAMC_BASE      (0x01c01000UL)                              // Literal only found in the DDR init payload
+#define PLL_CPU_CTRL    (0x01c20000UL)
+#define PLL_DDR_CTRL    (0x01c20020UL)
+#define CPU_CLK_SRC     (0x01c20050UL)
+#define AHB_APB_CFG     (0x01c20054UL)
+#define BUS_CLK_GATING0 (0x01c20060UL)
+
+#define SIM_AHB_HZ      (204e6)                                     // PLL_CPU at 408 MHz, AHB = CPU / 2
+
+extern struct chip_t f1c100s_f1c200s_f1c500s;
+
+#define SIM_DEVICES_MAX 8
+
+static struct sim_dev devs[SIM_DEVICES_MAX];
+static int ndevs;
+
+void sim_fail(const char *msg, uint32_t addr)
+{
+    fprintf(stderr, "\nsim: %s (0x%08x)\n", msg, addr);
+    exit(-1);
+}
+
+void sim_advance(struct sim_dev *d, double dt, double *bucket)
+{
+    d->now += dt;
+    if (bucket) {
+        *bucket += dt;
+    }
+    if (d->realtime && (d->now - d->slept) > 0.001) {
+        usleep((useconds_t)((d->now - d->slept) * 1e6));
+        d->slept = d->now;
+    }
+}
+
+static void sim_timing(struct sim_timing *t, const char *spec)
+{
+    t->usb_bps    = 24e6;
+    t->usb_fs_bps = 0.9e6;
+    t->usb_req    = 1000e-6;
+    t->usb_dev    = 150e-6;
+    t->exec       = 100e-6;
+    t->cpu_bps    = 40e6;
+    t->spi_max_hz = 80e6;
+    t->t_r        = 60e-6;
+    t->t_rcbsy    = 3e-6;
+    t->t_prog     = 250e-6;
+    t->t_bers     = 2000e-6;
+
+    while (spec && *spec) {
+        char key[16];
+        double val;
+        int n;
+        if (sscanf(spec, "%15[^=]=%lf%n", key, &val, &n) != 2) {
+            fprintf(stderr, "sim: bad timing spec '%s'\n", spec);
+            return;
+        }
+        if (!strcmp(key, "usb")) {
+            t->usb_bps = val * 1e6;
+        } else if (!strcmp(key, "usb_fs")) {
+            t->usb_fs_bps = val * 1e6;
+        } else if (!strcmp(key, "req")) {
+            t->usb_req = val * 1e-6;
+        } else if (!strcmp(key, "dev")) {
+            t->usb_dev = val * 1e-6;
+        } else if (!strcmp(key, "exec")) {
+            t->exec = val * 1e-6;
+        } else if (!strcmp(key, "cpu")) {
+            t->cpu_bps = val * 1e6;
+        } else if (!strcmp(key, "spi_max")) {
+            t->spi_max_hz = val * 1e6;
+        } else if (!strcmp(key, "tR")) {
+            t->t_r = val * 1e-6;
+        } else if (!strcmp(key, "tRCBSY")) {
+            t->t_rcbsy = val * 1e-6;
+        } else if (!strcmp(key, "tPROG")) {
+            t->t_prog = val * 1e-6;
+        } else if (!strcmp(key, "tBERS")) {
+            t->t_bers = val * 1e-6;
+        } else {
+            fprintf(stderr, "sim: unknown timing key '%s'\n", key);
+        }
+        spec += n;
+        spec += (*spec == ',');
+    }
+}
+
+uint8_t * sim_mem(struct sim_dev *d, uint32_t addr, size_t len)
+{
+    if (addr < SRAM_SZ && len <= SRAM_SZ - addr) {
+        return &d->sram[addr];
+    }
+    if (addr >= SDRAM_ADDR && (addr - SDRAM_ADDR) < SDRAM_SZ && len <= SDRAM_SZ - (addr - SDRAM_ADDR)) {
+        if (!d->sdram) {
+            sim_fail("SDRAM access before DDR init", addr);
+        }
+        return &d->dram[addr - SDRAM_ADDR];
+    }
+    return NULL;
+}
+
+static void usb_xfer(struct sim_dev *d, size_t len)
+{
+    double bps = d->hs ? d->t.usb_bps : d->t.usb_fs_bps;
+    do {
+        size_t n = (len > FEL_CHUNK) ? FEL_CHUNK : len;
+        d->s.requests++;
+        d->s.usb_bytes += n;
+        sim_advance(d, d->t.usb_req + (n / bps), &d->s.usb);
+        len -= n;
+    } while (len > 0);
+}
+
+static void spi_tx(struct sim_dev *d, const uint8_t *buf, uint32_t len)
+{
+    sim_advance(d, len * 8 / d->spi_hz, &d->s.spi);
+    sim_nand_tx(d, buf, len);
+}
+
+// lines is 1, or 2 for the dual read, 4 bits a clock
+static void spi_rx(struct sim_dev *d, uint8_t *buf, uint32_t len, int lines)
+{
+    sim_advance(d, len * 8 / lines / d->spi_hz, &d->s.spi);
+    sim_nand_rx(d, buf, len, lines);
+}
+
+static uint32_t le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = (v>>0)  & 0xFF;
+    p[1] = (v>>8)  & 0xFF;
+    p[2] = (v>>16) & 0xFF;
+    p[3] = (v>>24) & 0xFF;
+}
+
+static void spi_pack(struct sim_dev *d, uint32_t addr, uint32_t page_size, uint32_t pages, uint32_t map)
+{
+    uint8_t *p = sim_mem(d, addr, (size_t)page_size * pages);
+    uint8_t *m = sim_mem(d, map, 4 + (pages + 31) / 32 * 4);
+    uint32_t used = 0;
+
+    if (!p || !m) {
+        sim_fail("SPI_CMD_PACK outside of memory", addr);
+    }
+    memset(&m[4], 0, (pages + 31) / 32 * 4);
+    for (uint32_t i = 0; i < pages; i++) {
+        const uint8_t *page = &p[(size_t)i * page_size];
+        if (!image_page_empty(page, page_size)) {
+            m[4 + i / 8] |= 1 << (i % 8);
+            memmove(&p[(size_t)used++ * page_size], page, page_size);
+        }
+    }
+    put_le32(m, used);
+    sim_advance(d, (double)page_size * pages / 4 / d->t.cpu_bps, &d->s.cpu);  // A word compare per 4 bytes, against a table lookup per byte for the CRC
+}
+
+static void spi_clock(struct sim_dev *d, uint32_t ccr)
+{
+    d->spi_hz = (ccr & SPI_CCR_DRS) ? SIM_AHB_HZ / (2 * ((ccr & 0xff) + 1)) : SIM_AHB_HZ / (1U << ((ccr >> 8) & 0xf));
+}
+
+static void spi_run(struct sim_dev *d)
+{
+    const uint8_t *c = sim_mem(d, SDRAM_CMDBUF, SDRAM_CMDBUF_SZ);
+    const uint8_t *end = c + SDRAM_CMDBUF_SZ;
+    uint32_t addr, len;
+
+    while (c < end) {
+        switch (*c++) {
+        case SPI_CMD_INIT:
+            spi_clock(d, SPI_CCR_DEFAULT);
+            break;
+
+        case SPI_CMD_SELECT:
+            sim_nand_select(d);
+            break;
+
+        case SPI_CMD_DESELECT:
+            sim_nand_deselect(d);
+            break;
+
+        case SPI_CMD_FAST:
+            len = *c++;
+            spi_tx(d, c, len);
+            c += len;
+            break;
+
+        case SPI_CMD_TXBUF:
+            addr = le32(c);
+            len = le32(c + 4);
+            c += 8;
+            if (!sim_mem(d, addr, len)) {
+                sim_fail("SPI_CMD_TXBUF outside of memory", addr);
+            }
+            spi_tx(d, sim_mem(d, addr, len), len);
+            break;
+
+        case SPI_CMD_RXBUF:
+        case SPI_CMD_RXBUF_DUAL:
+            addr = le32(c);
+            len = le32(c + 4);
+            if (!sim_mem(d, addr, len)) {
+                sim_fail("SPI_CMD_RXBUF outside of memory", addr);
+            }
+            spi_rx(d, sim_mem(d, addr, len), len, (c[-1] == SPI_CMD_RXBUF_DUAL) ? 2 : 1);
+            c += 8;
+            break;
+
+        case SPI_CMD_SPINAND_WAIT:
+            sim_nand_wait(d);
+            break;
+
+        case SPI_CMD_CRC32:
+            addr = le32(c);
+            len = le32(c + 4);
+            if (!sim_mem(d, addr, len) || !sim_mem(d, le32(c + 8), 4)) {
+                sim_fail("SPI_CMD_CRC32 outside of memory", addr);
+            }
+            put_le32(sim_mem(d, le32(c + 8), 4), crc32_update(0, sim_mem(d, addr, len), len));
+            sim_advance(d, len / d->t.cpu_bps, &d->s.cpu);
+            c += 12;
+            break;
+
+        case SPI_CMD_PACK:
+            spi_pack(d, le32(c), le32(c + 4), le32(c + 8), le32(c + 12));
+            c += 16;
+            break;
+
+        default:                                                    // SPI_CMD_END, or anything the payload doesn't know
+            return;
+        }
+    }
+}
+
+static int has_literal(const uint8_t *p, uint32_t len, uint32_t val)
+{
+    for (uint32_t i = 0; i + 4 <= len; i += 4) {
+        if (le32(&p[i]) == val) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static void sim_reg_write(struct sim_dev *d, uint32_t addr, uint32_t val)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(d->regs); i++) {
+        if (d->regs[i].addr == addr || d->regs[i].addr == 0) {
+            d->regs[i].addr = addr;
+            d->regs[i].val = val;
+            return;
+        }
+    }
+}
+
+// What the DDR init payload leaves behind that the host can see
+// What the BROM leaves: clocks as SIM_AHB_HZ says
+static void sim_clocks_init(struct sim_dev *d)
+{
+    sim_reg_write(d, PLL_CPU_CTRL, (1UL << 31) | (16 << 8));       // N = 17
+    sim_reg_write(d, CPU_CLK_SRC, 2UL << 16);                       // PLL_CPU
+    sim_reg_write(d, AHB_APB_CFG, (2UL << 12) | (1 << 8) | (1 << 4)); // CPU clock / 2, APB = AHB / 2
+    spi_clock(d, SPI_CCR_DEFAULT);
+}
+
+static void sim_sdram_init(struct sim_dev *d)
+{
+    d->sdram = 1;
+    sim_reg_write(d, PLL_DDR_CTRL, 1UL << 31);
+    sim_reg_write(d, BUS_CLK_GATING0, 1UL << 14);
+}
+
+static int sim_dev_init(struct sim_dev *d, int i)
+{
+    const char *chip = getenv("DSOFLASH_SIM_CHIP");
+    const char *flash = getenv("DSOFLASH_SIM_FLASH");
+    char backing[4096];
+
+    if (flash && i > 0) {                                           // Second device on flash.1 and so on
+        snprintf(backing, sizeof (backing), "%s.%d", flash, i);
+        flash = backing;
+    }
+    memset(d, 0, sizeof (*d));
+    d->usb.dev = d;
+    d->bus = 1;
+    d->port = i + 1;
+    sim_timing(&d->t, getenv("DSOFLASH_SIM_TIMING"));
+    d->realtime = (getenv("DSOFLASH_SIM_REALTIME") != NULL);
+    d->sram = calloc(1, SRAM_SZ);
+    d->dram = calloc(1, SDRAM_SZ);
+    if (!d->sram || !d->dram) {
+        return 0;
+    }
+    sim_clocks_init(d);
+    if (getenv("DSOFLASH_SIM_HS")) {                                // As left by an earlier run
+        d->hs = 1;
+        sim_sdram_init(d);
+        put_le32(sim_mem(d, SDRAM_SIGNATURE, 4), SDRAM_SIGNATURE_0);
+        put_le32(sim_mem(d, SDRAM_SIGNATURE + 4, 4), SDRAM_SIGNATURE_1);
+    }
+    if (!sim_nand_init(d, chip ? chip : "W25N01GV", flash)) {
+        return 0;
+    }
+    d->nand.cache_program |= (getenv("DSOFLASH_SIM_CACHE_PROGRAM") != NULL);  // Model it on any chip
+    return 1;
+}
+
+static void sim_dev_exit(struct sim_dev *d)
+{
+    struct sim_stats *s = &d->s;
+
+    if (ndevs > 1) {
+        fprintf(stderr, "\nsim: device %u-%u", d->bus, d->port);
+    }
+    fprintf(stderr, "\nsim: %s, %.3f s modeled (usb %.3f s, spi %.3f s, busy %.3f s, exec %.3f s, cpu %.3f s)\n",
+            d->nand.info ? d->nand.info->name : "?", d->now, s->usb, s->spi, s->busy, s->exec, s->cpu);
+    fprintf(stderr, "sim: %u FEL requests, %.1f MiB over USB, %u page reads, %u programs, %u erases",
+            s->requests, s->usb_bytes / (1024.0*1024), s->reads, s->programs, s->erases);
+    if (s->violations) {
+        fprintf(stderr, ", %u PROTOCOL VIOLATIONS", s->violations);
+    }
+    fprintf(stderr, "\n");
+
+    sim_nand_exit(d);
+    free(d->sram);
+    free(d->dram);
+    free(d->wire.q);
+}
+
+int libusb_init(libusb_context **context)
+{
+    const char *n = getenv("DSOFLASH_SIM_DEVICES");
+
+    (void)context;
+    ndevs = n ? atoi(n) : 1;
+    if (ndevs < 1 || ndevs > SIM_DEVICES_MAX) {
+        fprintf(stderr, "sim: DSOFLASH_SIM_DEVICES must be 1..%d\n", SIM_DEVICES_MAX);
+        ndevs = 0;
+        return LIBUSB_ERROR_IO;
+    }
+    for (int i = 0; i < ndevs; i++) {
+        if (!sim_dev_init(&devs[i], i)) {
+            ndevs = i + 1;                                          // Report and free what was set up
+            return LIBUSB_ERROR_IO;
+        }
+    }
+    return 0;
+}
+
+void libusb_exit(libusb_context *context)
+{
+    (void)context;
+    fflush(stdout);
+    for (int i = 0; i < ndevs; i++) {
+        sim_dev_exit(&devs[i]);
+    }
+    ndevs = 0;
+}
+
+ssize_t libusb_get_device_list(libusb_context *context, libusb_device ***list)
+{
+    (void)context;
+    *list = calloc(ndevs + 1, sizeof (**list));
+    if (!*list) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    for (int i = 0; i < ndevs; i++) {
+        (*list)[i] = &devs[i].usb;
+    }
+    return ndevs;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref_devices)
+{
+    (void)unref_devices;
+    free(list);
+}
+
+int libusb_get_device_descriptor(libusb_device *usb, struct libusb_device_descriptor *desc)
+{
+    (void)usb;
+    memset(desc, 0, sizeof (*desc));
+    desc->idVendor = 0x1f3a;
+    desc->idProduct = 0xefe8;
+    return 0;
+}
+
+uint8_t libusb_get_bus_number(libusb_device *usb)
+{
+    return usb->dev->bus;
+}
+
+int libusb_get_device_speed(libusb_device *usb)
+{
+    return usb->dev->hs ? LIBUSB_SPEED_HIGH : LIBUSB_SPEED_FULL;
+}
+
+int libusb_get_port_numbers(libusb_device *usb, uint8_t *port_numbers, int port_numbers_len)
+{
+    if (port_numbers_len < 1) {
+        return LIBUSB_ERROR_OVERFLOW;
+    }
+    port_numbers[0] = usb->dev->port;
+    return 1;
+}
+
+int libusb_open(libusb_device *usb, libusb_device_handle **hdl)
+{
+    *hdl = malloc(sizeof (**hdl));
+    if (!*hdl) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    (*hdl)->dev = usb->dev;
+    return 0;
+}
+
+libusb_device * libusb_get_device(libusb_device_handle *hdl)
+{
+    return &hdl->dev->usb;
+}
+
+libusb_device_handle * libusb_open_device_with_vid_pid(libusb_context *context, uint16_t vid, uint16_t pid)
+{
+    libusb_device_handle *hdl;
+
+    (void)context;
+    if (!ndevs || vid != 0x1f3a || pid != 0xefe8 || libusb_open(&devs[0].usb, &hdl) != 0) {
+        return NULL;
+    }
+    return hdl;
+}
+
+void libusb_close(libusb_device_handle *hdl)
+{
+    free(hdl);
+}
+
+
+int fel_init(struct xfel_ctx_t *ctx)
+{
+    if (!ctx->hdl) {
+        return 0;
+    }
+    memset(&ctx->version, 0, sizeof (ctx->version));
+    memcpy(ctx->version.magic, "AWUSBFEX", 8);
+    ctx->version.id = 0x00166300;
+    ctx->version.protocol = 1;
+    ctx->version.scratchpad = 0x7e00;
+    ctx->epout = 0x01;
+    ctx->epin = 0x82;
+    ctx->chip = &f1c100s_f1c200s_f1c500s;
+    usb_xfer(ctx->hdl->dev, 32);
+    return 1;
+}
+
+void sim_exec(struct sim_dev *d, uint32_t addr)
+{
+    sim_advance(d, d->t.exec, &d->s.exec);
+    if (addr != PAYLOAD_ADDR) {
+        sim_fail("exec of unknown code", addr);
+    }
+    if (has_literal(&d->sram[addr], d->payload_len, SPI0_BASE)) {
+        spi_run(d);
+    } else if (has_literal(&d->sram[addr], d->payload_len, DRAMC_BASE)) {
+        sim_sdram_init(d);
+    }
+}
+
+void sim_write(struct sim_dev *d, uint32_t addr, const void *buf, size_t len)
+{
+    uint8_t *p = sim_mem(d, addr, len);
+
+    if (!p) {
+        sim_fail("write outside of memory", addr);
+    }
+    memcpy(p, buf, len);
+    if (addr == PAYLOAD_ADDR) {
+        d->payload_len = len;
+    }
+}
+
+void sim_read(struct sim_dev *d, uint32_t addr, void *buf, size_t len)
+{
+    uint8_t *p = sim_mem(d, addr, len);
+
+    if (!p) {
+        sim_fail("read outside of memory", addr);
+    }
+    memcpy(buf, p, len);
+}
+
+uint32_t fel_read32(struct xfel_ctx_t *ctx, uint32_t addr)
+{
+    struct sim_dev *d = ctx->hdl->dev;
+    uint8_t *p = sim_mem(d, addr, 4);
+
+    usb_xfer(d, 4);
+    if (p) {
+        return le32(p);
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(d->regs); i++) {
+        if (d->regs[i].addr == addr) {
+            return d->regs[i].val;
+        }
+    }
+    return 0;
+}
+
+void fel_write32(struct xfel_ctx_t *ctx, uint32_t addr, uint32_t val)
+{
+    struct sim_dev *d = ctx->hdl->dev;
+    uint8_t *p = sim_mem(d, addr, 4);
+
+    usb_xfer(d, 4);
+    if (p) {
+        memcpy(p, &val, 4);
+        return;
+    }
+    if (addr == 0x01c13040) {                                       // USB PHY: switch to high speed
+        d->hs = 1;
+    } else if (addr == SPI0_CCR) {
+        spi_clock(d, val);
+    }
+    sim_reg_write(d, addr, val);
+}
+
+void fel_exec(struct xfel_ctx_t *ctx, uint32_t addr)
+{
+    struct sim_dev *d = ctx->hdl->dev;
+
+    usb_xfer(d, 0);
+    sim_exec(d, addr);
+}
+
+void fel_read(struct xfel_ctx_t *ctx, uint32_t addr, void *buf, size_t len)
+{
+    struct sim_dev *d = ctx->hdl->dev;
+
+    usb_xfer(d, len);
+    sim_read(d, addr, buf, len);
+}
+
+void fel_write(struct xfel_ctx_t *ctx, uint32_t addr, void *buf, size_t len)
+{
+    struct sim_dev *d = ctx->hdl->dev;
+
+    usb_xfer(d, len);
+    sim_write(d, addr, buf, len);
+}
+
+int fel_spi_init(struct xfel_ctx_t *ctx, uint32_t *swapbuf, uint32_t *swaplen, uint32_t *cmdlen)
+{
+    uint8_t cbuf[2] = { SPI_CMD_INIT, SPI_CMD_END };
+
+    if (!fel_chip_spi_init(ctx, swapbuf, swaplen, cmdlen)) {
+        return 0;
+    }
+    return fel_chip_spi_run(ctx, cbuf, sizeof (cbuf));
+}
+
+int fel_spi_xfer(struct xfel_ctx_t *ctx, uint32_t swapbuf, uint32_t swaplen, uint32_t cmdlen, void *txbuf, uint32_t txlen, void *rxbuf, uint32_t rxlen)
+{
+    uint8_t cbuf[32];
+    uint32_t clen = 0;
+
+    if (txlen > swaplen || rxlen > swaplen) {
+        return 0;
+    }
+    cbuf[clen++] = SPI_CMD_SELECT;
+    if (txlen > 0) {
+        cbuf[clen++] = SPI_CMD_TXBUF;
+        memcpy(&cbuf[clen], &swapbuf, 4);
+        memcpy(&cbuf[clen + 4], &txlen, 4);
+        clen += 8;
+    }
+    if (rxlen > 0) {
+        cbuf[clen++] = SPI_CMD_RXBUF;
+        memcpy(&cbuf[clen], &swapbuf, 4);
+        memcpy(&cbuf[clen + 4], &rxlen, 4);
+        clen += 8;
+    }
+    cbuf[clen++] = SPI_CMD_DESELECT;
+    cbuf[clen++] = SPI_CMD_END;
+    if (clen > cmdlen) {
+        return 0;
+    }
+
+    if (txlen > 0) {
+        fel_write(ctx, swapbuf, txbuf, txlen);
+    }
+    fel_chip_spi_run(ctx, cbuf, clen);
+    if (rxlen > 0) {
+        fel_read(ctx, swapbuf, rxbuf, rxlen);
+    }
+    return 1;
+}
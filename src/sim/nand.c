@@ -0,0 +1,438 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sim.h"
+
+enum {
+    STATUS_OIP    = 0x01,
+    STATUS_WEL    = 0x02,
+    STATUS_E_FAIL = 0x04,
+    STATUS_P_FAIL = 0x08,
+
+    PROTECT_BP    = 0x78,                                           // BP3..BP0 (Winbond), BP2..BP0 + BRWD (Gigadevice)
+};
+
+static void violation(struct sim_dev *d, const char *what)
+{
+    if (!d->s.violations++) {
+        fprintf(stderr, "\nsim: %s (opcode 0x%02x)\n", what, d->nand.hdr[0]);
+    }
+}
+
+static uint32_t header_len(uint8_t op)
+{
+    switch (op) {
+    case OPCODE_GET_FEATURE:
+    case OPCODE_DIE_SELECT:
+        return 2;
+    case OPCODE_SET_FEATURE:
+    case OPCODE_PROGRAM_LOAD:
+        return 3;
+    case OPCODE_READ_PAGE_TO_CACHE:
+    case OPCODE_READ_PAGE_FROM_CACHE:
+    case OPCODE_READ_CACHE_X2:
+    case OPCODE_BLOCK_ERASE:
+    case OPCODE_PROGRAM_EXEC:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+static struct sim_die * die(struct sim_dev *d)
+{
+    return &d->nand.die[d->nand.sel];
+}
+
+static int busy(struct sim_dev *d)
+{
+    return d->now < die(d)->busy_until;
+}
+
+static uint32_t row_addr(const struct sim_nand *n)
+{
+    return ((uint32_t)n->hdr[1] << 16) | ((uint32_t)n->hdr[2] << 8) | n->hdr[3];
+}
+
+static uint32_t die_pages(const struct sim_nand *n)
+{
+    return n->info->pages_per_block * n->info->blocks_per_die;
+}
+
+// Plane the column address picks, and the one page is in: blocks alternate between planes
+static uint32_t col_plane(const struct sim_nand *n)
+{
+    return ((((uint32_t)n->hdr[1] << 8) | n->hdr[2]) / (n->info->page_size * 2)) & 1;
+}
+
+static uint32_t page_plane(const struct sim_nand *n, uint32_t page)
+{
+    return (page / n->info->pages_per_block) % n->info->planes_per_die;
+}
+
+static uint32_t col_addr(const struct sim_nand *n)
+{
+    return (((uint32_t)n->hdr[1] << 8) | n->hdr[2]) & ((n->info->page_size * 2) - 1);     // Drop the plane select bit
+}
+
+static uint8_t get_feature(struct sim_dev *d, uint8_t addr)
+{
+    struct sim_die *x = die(d);
+    switch (addr) {
+    case OPCODE_FEATURE_PROTECT:
+        return x->protect;
+    case OPCODE_FEATURE_CONFIG:
+        return x->config;
+    case OPCODE_FEATURE_STATUS:
+        return x->status | (busy(d) ? STATUS_OIP : 0);
+    case OPCODE_FEATURE_DIE:
+        return (d->nand.info->flags & SPINAND_DIE_FEATURE) ? d->nand.sel << 6 : 0;
+    default:
+        return 0;
+    }
+}
+
+int sim_nand_init(struct sim_dev *d, const char *chip, const char *backing)
+{
+    struct sim_nand *n = &d->nand;
+
+    n->info = spinand_lookup(chip);
+    if (!n->info) {
+        fprintf(stderr, "sim: unknown chip '%s'\n", chip);
+        return 0;
+    }
+
+    uint32_t ps = n->info->page_size, ss = n->info->spare_size;
+    n->pages = n->info->pages_per_block * n->info->blocks_per_die * n->info->ndies;
+    n->array_sz = (size_t)n->pages * ps;
+
+    if (backing) {
+        struct stat st;
+        int fd = open(backing, O_RDWR | O_CREAT, 0644);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            fprintf(stderr, "sim: unable to open %s\n", backing);
+            return 0;
+        }
+        int fresh = (st.st_size == 0);
+        if (fresh && ftruncate(fd, n->array_sz) < 0) {
+            close(fd);
+            return 0;
+        }
+        if (!fresh && (size_t)st.st_size != n->array_sz) {
+            fprintf(stderr, "sim: %s is %zu bytes, %s needs %zu\n", backing, (size_t)st.st_size, chip, n->array_sz);
+            close(fd);
+            return 0;
+        }
+        n->array = mmap(NULL, n->array_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (n->array == MAP_FAILED) {
+            n->array = NULL;
+            return 0;
+        }
+        if (fresh) {
+            memset(n->array, 0xFF, n->array_sz);
+        }
+    } else {
+        n->array = mmap(NULL, n->array_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (n->array == MAP_FAILED) {
+            n->array = NULL;
+            return 0;
+        }
+        memset(n->array, 0xFF, n->array_sz);
+    }
+
+    n->spare = malloc((size_t)n->pages * ss);
+    if (!n->spare || n->info->ndies > SPINAND_DIES_MAX) {
+        return 0;
+    }
+    memset(n->spare, 0xFF, (size_t)n->pages * ss);
+
+    for (uint32_t i = 0; i < n->info->ndies; i++) {
+        struct sim_die *x = &n->die[i];
+        if (!(x->cache = malloc(ps + ss))) {
+            return 0;
+        }
+        memset(x->cache, 0xFF, ps + ss);
+        x->protect = PROTECT_BP | 0x04;                             // Block protection is set at power-up
+        x->config = 0x10;                                           // ECC enabled
+    }
+    n->sel = 0;
+    n->cache_program = (n->info->flags & SPINAND_CACHE_PROGRAM) != 0;
+    return 1;
+}
+
+void sim_nand_exit(struct sim_dev *d)
+{
+    struct sim_nand *n = &d->nand;
+    if (n->array) {
+        munmap(n->array, n->array_sz);
+    }
+    free(n->spare);
+    for (uint32_t i = 0; i < SPINAND_DIES_MAX; i++) {
+        free(n->die[i].cache);
+    }
+    memset(n, 0, sizeof (*n));
+}
+
+void sim_nand_select(struct sim_dev *d)
+{
+    d->nand.hlen = 0;
+    d->nand.col = 0;
+}
+
+void sim_nand_tx(struct sim_dev *d, const uint8_t *buf, uint32_t len)
+{
+    struct sim_nand *n = &d->nand;
+    struct sim_die *x = die(d);
+    uint32_t cache_sz = n->info->page_size + n->info->spare_size;
+
+    for (uint32_t i = 0; i < len; i++) {
+        if (n->hlen == 0 || n->hlen < header_len(n->hdr[0]) || (n->hdr[0] != OPCODE_PROGRAM_LOAD && n->hlen < sizeof (n->hdr))) {
+            if (n->hlen < sizeof (n->hdr)) {
+                n->hdr[n->hlen++] = buf[i];
+            }
+            if (n->hdr[0] == OPCODE_PROGRAM_LOAD && n->hlen == header_len(OPCODE_PROGRAM_LOAD)) {
+                if (busy(d) && !(n->cache_program && x->busy_op == OPCODE_PROGRAM_EXEC)) {
+                    violation(d, "program load while busy");
+                }
+                memset(x->cache, 0xFF, cache_sz);                   // Program load clears the whole buffer
+                n->col = col_addr(n);
+                x->load_plane = col_plane(n);
+            }
+            continue;
+        }
+        if (n->col < cache_sz) {                                    // PROGRAM_LOAD data phase
+            x->cache[n->col++] = buf[i];
+        }
+    }
+}
+
+// lines is how many data lines the host samples, 2 only makes sense after OPCODE_READ_CACHE_X2
+void sim_nand_rx(struct sim_dev *d, uint8_t *buf, uint32_t len, int lines)
+{
+    struct sim_nand *n = &d->nand;
+    struct sim_die *x = die(d);
+    uint32_t cache_sz = n->info->page_size + n->info->spare_size;
+
+    if (n->hlen == 0) {
+        memset(buf, 0xFF, len);
+        return;
+    }
+
+    if ((lines == 2) != (n->hdr[0] == OPCODE_READ_CACHE_X2)) {
+        violation(d, "data read on the wrong number of lines");
+    }
+    switch (n->hdr[0]) {
+    case OPCODE_RDID:
+        for (uint32_t i = 0; i < len; i++) {                        // Without the dummy byte the first byte out is garbage
+            uint32_t k = (n->hlen > 1) ? i : i - 1;
+            buf[i] = (n->hlen == 1 && i == 0) ? 0x00 : (k < n->info->id.len) ? n->info->id.val[k] : 0x00;
+        }
+        break;
+
+    case OPCODE_GET_FEATURE:
+        memset(buf, get_feature(d, n->hdr[1]), len);
+        break;
+
+    case OPCODE_READ_PAGE_FROM_CACHE:
+    case OPCODE_READ_CACHE_X2:
+        if (busy(d)) {
+            violation(d, "cache read while busy");
+        }
+        if (n->col == 0 && col_plane(n) != page_plane(n, x->cache_page)) {
+            violation(d, "cache read from the wrong plane");
+        }
+        for (uint32_t i = 0; i < len; i++) {
+            buf[i] = (n->col + col_addr(n) < cache_sz) ? x->cache[col_addr(n) + n->col] : 0xFF;
+            n->col++;
+        }
+        if (d->spi_hz > d->t.spi_max_hz && len) {                  // Sampled past the end of a bit now and then,
+            n->garbled = n->garbled * 1103515245U + 12345U;         // never at the same place twice in a row
+            buf[(n->garbled >> 8) % len] ^= 1 << ((n->garbled >> 28) & 7);
+        }
+        break;
+
+    default:
+        memset(buf, 0xFF, len);
+        break;
+    }
+}
+
+// The die selects go to the stack, not to a die, and are taken while dies are busy
+static int die_select(struct sim_dev *d)
+{
+    struct sim_nand *n = &d->nand;
+    uint32_t sel;
+
+    if (n->hdr[0] == OPCODE_DIE_SELECT) {
+        if (n->info->flags & SPINAND_DIE_FEATURE) {
+            violation(d, "die select on a chip picking dies by feature");
+            return 1;
+        }
+        sel = n->hdr[1];
+    } else if (n->hdr[0] == OPCODE_SET_FEATURE && n->hdr[1] == OPCODE_FEATURE_DIE) {
+        if (!(n->info->flags & SPINAND_DIE_FEATURE)) {
+            violation(d, "die feature on a chip without it");
+            return 1;
+        }
+        sel = n->hdr[2] >> 6;
+    } else {
+        return 0;
+    }
+    if (sel >= n->info->ndies) {
+        violation(d, "die select out of range");
+        return 1;
+    }
+    n->sel = sel;
+    return 1;
+}
+
+void sim_nand_deselect(struct sim_dev *d)
+{
+    struct sim_nand *n = &d->nand;
+    struct sim_die *x = die(d);
+    uint32_t ps = n->info->page_size, ss = n->info->spare_size;
+
+    if (n->hlen < header_len(n->hdr[0]) || n->hlen == 0) {
+        n->hlen = 0;
+        return;
+    }
+    if (die_select(d)) {
+        n->hlen = 0;
+        return;
+    }
+
+    uint8_t op = n->hdr[0];
+    if (busy(d) && op != OPCODE_GET_FEATURE && op != OPCODE_RESET && op != OPCODE_READ_PAGE_FROM_CACHE && op != OPCODE_READ_CACHE_X2
+     && op != OPCODE_PROGRAM_LOAD) {
+        violation(d, "command while busy");
+        n->hlen = 0;
+        return;
+    }
+    if (x->seq && op != OPCODE_GET_FEATURE && op != OPCODE_RESET && op != OPCODE_READ_PAGE_FROM_CACHE && op != OPCODE_READ_CACHE_X2
+     && op != OPCODE_READ_CACHE_SEQ && op != OPCODE_READ_CACHE_END) {
+        violation(d, "cache read not ended");
+    }
+
+    uint32_t row = row_addr(n);                                     // Within the selected die
+    uint32_t page = (row < die_pages(n)) ? n->sel * die_pages(n) + row : n->pages;
+    switch (op) {
+    case OPCODE_WRITE_ENABLE:
+        x->status |= STATUS_WEL;
+        break;
+
+    case OPCODE_SET_FEATURE:
+        if (n->hdr[1] == OPCODE_FEATURE_PROTECT) {
+            x->protect = n->hdr[2];
+        } else if (n->hdr[1] == OPCODE_FEATURE_CONFIG) {
+            x->config = n->hdr[2];
+        }
+        break;
+
+    case OPCODE_READ_PAGE_TO_CACHE:
+        if (page >= n->pages) {
+            violation(d, "page read out of range");
+            break;
+        }
+        memcpy(x->cache, &n->array[(size_t)page * ps], ps);
+        memcpy(&x->cache[ps], &n->spare[(size_t)page * ss], ss);
+        x->cache_page = page;
+        x->busy_until = d->now + d->t.t_r;
+        x->busy_op = op;
+        x->reg_page = page;
+        x->reg_until = x->busy_until;
+        x->seq = 0;
+        d->s.reads++;
+        break;
+
+    case OPCODE_READ_CACHE_SEQ:                                     // Cache takes the data register, the array loads the next page
+    case OPCODE_READ_CACHE_END:                                     // Cache takes the data register, nothing more is loaded
+        if (!(n->info->flags & SPINAND_CACHE_READ)) {
+            violation(d, "cache read on a chip without it");
+            break;
+        }
+        x->busy_until = ((x->reg_until > d->now) ? x->reg_until : d->now) + d->t.t_rcbsy;
+        x->busy_op = op;
+        memcpy(x->cache, &n->array[(size_t)x->reg_page * ps], ps);
+        memcpy(&x->cache[ps], &n->spare[(size_t)x->reg_page * ss], ss);
+        x->cache_page = x->reg_page;
+        x->seq = (op == OPCODE_READ_CACHE_SEQ);
+        if (x->seq) {
+            if (++x->reg_page % die_pages(n) == 0) {                // Sequential reads stay on their die
+                violation(d, "cache read out of range");
+                x->reg_page = n->sel * die_pages(n);
+            }
+            x->reg_until = x->busy_until + d->t.t_r;
+            d->s.reads++;
+        }
+        break;
+
+    case OPCODE_PROGRAM_EXEC:
+        x->status &= ~STATUS_P_FAIL;
+        if (!(x->status & STATUS_WEL) || page >= n->pages) {
+            violation(d, "program without write enable or out of range");
+            break;
+        }
+        if (x->load_plane != page_plane(n, page)) {
+            violation(d, "program loaded into the wrong plane");
+        }
+        x->status &= ~STATUS_WEL;
+        if (x->protect & PROTECT_BP) {
+            x->status |= STATUS_P_FAIL;
+            break;
+        }
+        for (uint32_t i = 0; i < ps; i++) {                        // Programming can only clear bits
+            n->array[(size_t)page * ps + i] &= x->cache[i];
+        }
+        for (uint32_t i = 0; i < ss; i++) {
+            n->spare[(size_t)page * ss + i] &= x->cache[ps + i];
+        }
+        x->busy_until = d->now + d->t.t_prog;
+        x->busy_op = op;
+        d->s.programs++;
+        break;
+
+    case OPCODE_BLOCK_ERASE:
+        x->status &= ~STATUS_E_FAIL;
+        if (!(x->status & STATUS_WEL) || page >= n->pages) {
+            violation(d, "erase without write enable or out of range");
+            break;
+        }
+        x->status &= ~STATUS_WEL;
+        if (x->protect & PROTECT_BP) {
+            x->status |= STATUS_E_FAIL;
+            break;
+        }
+        page -= page % n->info->pages_per_block;
+        memset(&n->array[(size_t)page * ps], 0xFF, (size_t)n->info->pages_per_block * ps);
+        memset(&n->spare[(size_t)page * ss], 0xFF, (size_t)n->info->pages_per_block * ss);
+        x->busy_until = d->now + d->t.t_bers;
+        x->busy_op = op;
+        d->s.erases++;
+        break;
+
+    case OPCODE_RESET:
+        x->status = 0;
+        x->seq = 0;
+        x->busy_until = d->now + 0.0005;
+        x->busy_op = op;
+        break;
+
+    default:
+        break;
+    }
+    n->hlen = 0;
+}
+
+void sim_nand_wait(struct sim_dev *d)
+{
+    sim_advance(d, 3 * 8 / d->spi_hz, &d->s.spi);                // At least one GET_FEATURE poll
+    if (busy(d)) {
+        sim_advance(d, die(d)->busy_until - d->now, &d->s.busy);
+    }
+}
@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <fel.h>
+
+#include "../spinand.h"
+
+struct sim_timing {
+    double usb_bps;         // Bulk throughput in HS mode, bytes/s
+    double usb_fs_bps;      // Bulk throughput before the HS switch, bytes/s
+    double usb_req;         // Round trip of a single FEL request, s
+    double usb_dev;         // Device side handling of a FEL request when transfers are queued, s
+    double exec;            // Payload call overhead, s
+    double cpu_bps;         // Data crunched by payload extensions on the ARM core, bytes/s
+    double spi_max_hz;      // Fastest SCLK page data still reads back right at
+    double t_r;             // Page read to cache, s
+    double t_rcbsy;         // Cache busy of a sequential cache read, s
+    double t_prog;          // Page program, s
+    double t_bers;          // Block erase, s
+};
+
+struct sim_stats {
+    double usb, spi, busy, exec, cpu;
+    uint64_t usb_bytes;
+    uint32_t requests;
+    uint32_t reads, programs, erases;
+    uint32_t violations;
+};
+
+// Each die of a stack has its own page buffer, registers and busy state
+struct sim_die {
+    uint8_t *cache;         // Data + spare of the page buffer
+    uint32_t cache_page;    // Page last moved into the cache, for the plane check of cache reads
+    uint8_t protect, config, status;
+    double busy_until;
+    uint8_t busy_op;        // Opcode keeping the die busy
+    uint32_t reg_page;      // Page in the data register, behind the cache
+    double reg_until;       // and when it is loaded there
+    int seq;                // Sequential cache read going on, the array loads in the background
+    uint32_t load_plane;    // Plane bit of the last PROGRAM_LOAD column
+};
+
+struct sim_nand {
+    const struct spinand_info_t *info;
+    uint32_t pages;
+    uint8_t *array;         // Data area of all pages, backed by DSOFLASH_SIM_FLASH if set
+    size_t array_sz;
+    uint8_t *spare;         // Spare area of all pages, memory only
+    struct sim_die die[SPINAND_DIES_MAX];
+    uint32_t sel;           // Die the commands go to
+    int cache_program;      // Program load allowed while a program runs, SPINAND_CACHE_PROGRAM or DSOFLASH_SIM_CACHE_PROGRAM
+    uint32_t garbled;       // Cache reads clocked faster than spi_max_hz
+
+    uint8_t hdr[8];         // Opcode and address bytes of the current transaction
+    uint32_t hlen;
+    uint32_t col;           // Cache offset for PROGRAM_LOAD data
+};
+
+// FEL protocol decoder fed by the asynchronous transfers of usb.c
+struct sim_wire {
+    struct libusb_transfer **q;                 // Submitted, not yet handled transfers, in order
+    size_t head, tail, cap;
+
+    int usb_state;
+    uint16_t usb_type;
+    uint32_t usb_len;
+
+    int fel_state;
+    uint32_t fel_cmd, fel_addr, fel_len;
+};
+
+struct libusb_device {
+    struct sim_dev *dev;
+};
+
+struct sim_dev {
+    struct libusb_device usb;
+    uint8_t bus, port;      // Where the device shows up, see DSOFLASH_SIM_DEVICES
+    struct sim_timing t;
+    struct sim_stats s;
+    double now;             // Modeled time, s
+    double spi_hz;          // SCLK, from SPI0_CCR
+    double slept;           // Modeled time already spent in real time (DSOFLASH_SIM_REALTIME)
+    int realtime;
+    int hs;
+    int sdram;
+    uint8_t *sram;
+    uint8_t *dram;
+    struct sim_nand nand;
+    struct sim_wire wire;
+    struct {
+        uint32_t addr, val;
+    } regs[64];             // Last value written to registers outside of memory
+    uint32_t payload_len;
+};
+
+struct libusb_device_handle {
+    struct sim_dev *dev;
+};
+
+void sim_advance(struct sim_dev *d, double dt, double *bucket);
+void sim_fail(const char *msg, uint32_t addr);
+uint8_t * sim_mem(struct sim_dev *d, uint32_t addr, size_t len);
+void sim_read(struct sim_dev *d, uint32_t addr, void *buf, size_t len);
+void sim_write(struct sim_dev *d, uint32_t addr, const void *buf, size_t len);
+void sim_exec(struct sim_dev *d, uint32_t addr);
+
+int sim_nand_init(struct sim_dev *d, const char *chip, const char *backing);
+void sim_nand_exit(struct sim_dev *d);
+void sim_nand_select(struct sim_dev *d);
+void sim_nand_deselect(struct sim_dev *d);
+void sim_nand_tx(struct sim_dev *d, const uint8_t *buf, uint32_t len);
+void sim_nand_rx(struct sim_dev *d, uint8_t *buf, uint32_t len, int lines);
+void sim_nand_wait(struct sim_dev *d);
+
+#endif // SIM_H_
@@ -0,0 +1,213 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+/*
+ * Asynchronous libusb transfers for the simulator.
+ *
+ * Submitted transfers are kept in submission order and handed, on event
+ * handling, to a decoder of the FEL wire protocol (AWUC request, data phase,
+ * AWUS response; FEL request, data, status) that drives the same memory and
+ * payload model as the synchronous stand-ins in fel.c.
+ *
+ * With transfers queued ahead, the host turnaround of each request is hidden,
+ * so a FEL request costs the device side handling time (the "dev" timing key)
+ * instead of the full synchronous round trip ("req").
+ */
+
+#include "sim.h"
+
+enum {
+    AW_USB_READ    = 0x11,
+    AW_USB_WRITE   = 0x12,
+
+    AW_FEL_1_WRITE = 0x101,
+    AW_FEL_1_EXEC  = 0x102,
+    AW_FEL_1_READ  = 0x103,
+};
+
+enum {
+    USB_WANT_AWUC,
+    USB_WANT_DATA,
+    USB_WANT_AWUS,
+};
+
+enum {
+    FEL_IDLE,
+    FEL_DATA,
+    FEL_STATUS,
+};
+
+// libusb_handle_events_completed() isn't told which device to serve. Every
+// thread drives a single device (several in station mode), so events are
+// handled for the device the calling thread last submitted a transfer to.
+static __thread struct sim_dev *events_dev;
+
+static uint32_t le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void fel_out(struct sim_dev *d, const uint8_t *buf, uint32_t len)
+{
+    struct sim_wire *w = &d->wire;
+
+    if (w->fel_state == FEL_IDLE) {
+        if (len != 16) {
+            sim_fail("bad FEL request length", len);
+        }
+        w->fel_cmd = le32(&buf[0]);
+        w->fel_addr = le32(&buf[4]);
+        w->fel_len = le32(&buf[8]);
+        d->s.requests++;
+        sim_advance(d, d->t.usb_dev, &d->s.usb);
+        switch (w->fel_cmd) {
+        case AW_FEL_1_WRITE:
+        case AW_FEL_1_READ:
+            w->fel_state = FEL_DATA;
+            break;
+        case AW_FEL_1_EXEC:
+            sim_exec(d, w->fel_addr);
+            w->fel_state = FEL_STATUS;
+            break;
+        default:
+            sim_fail("unknown FEL request", w->fel_cmd);
+        }
+        return;
+    }
+    if (w->fel_state != FEL_DATA || w->fel_cmd != AW_FEL_1_WRITE || len != w->fel_len) {
+        sim_fail("unexpected FEL write data", w->fel_addr);
+    }
+    sim_write(d, w->fel_addr, buf, len);
+    w->fel_state = FEL_STATUS;
+}
+
+static void fel_in(struct sim_dev *d, uint8_t *buf, uint32_t len)
+{
+    struct sim_wire *w = &d->wire;
+
+    if (w->fel_state == FEL_DATA && w->fel_cmd == AW_FEL_1_READ && len == w->fel_len) {
+        sim_read(d, w->fel_addr, buf, len);
+        w->fel_state = FEL_STATUS;
+    } else if (w->fel_state == FEL_STATUS && len == 8) {
+        memset(buf, 0, len);
+        w->fel_state = FEL_IDLE;
+    } else {
+        sim_fail("unexpected FEL read", w->fel_addr);
+    }
+}
+
+static void usb_process(struct sim_dev *d, struct libusb_transfer *t)
+{
+    struct sim_wire *w = &d->wire;
+    int in = (t->endpoint & 0x80) != 0;
+    uint32_t len = t->length;
+
+    switch (w->usb_state) {
+    case USB_WANT_AWUC:
+        if (in || len != 32 || memcmp(t->buffer, "AWUC", 4) != 0) {
+            sim_fail("expected AWUC request", len);
+        }
+        w->usb_len = le32(&t->buffer[8]);
+        w->usb_type = t->buffer[16] | (t->buffer[17] << 8);
+        w->usb_state = USB_WANT_DATA;
+        break;
+
+    case USB_WANT_DATA:
+        if (len != w->usb_len || in != (w->usb_type == AW_USB_READ)) {
+            sim_fail("data phase does not match AWUC request", len);
+        }
+        d->s.usb_bytes += len;
+        sim_advance(d, len / (d->hs ? d->t.usb_bps : d->t.usb_fs_bps), &d->s.usb);
+        if (in) {
+            fel_in(d, t->buffer, len);
+        } else {
+            fel_out(d, t->buffer, len);
+        }
+        w->usb_state = USB_WANT_AWUS;
+        break;
+
+    case USB_WANT_AWUS:
+        if (!in || len != 13) {
+            sim_fail("expected AWUS response", len);
+        }
+        memset(t->buffer, 0, len);
+        memcpy(t->buffer, "AWUS", 4);
+        w->usb_state = USB_WANT_AWUC;
+        break;
+    }
+    t->actual_length = len;
+    t->status = LIBUSB_TRANSFER_COMPLETED;
+}
+
+struct libusb_transfer * libusb_alloc_transfer(int iso_packets)
+{
+    (void)iso_packets;
+    return calloc(1, sizeof (struct libusb_transfer));
+}
+
+void libusb_free_transfer(struct libusb_transfer *t)
+{
+    free(t);
+}
+
+int libusb_submit_transfer(struct libusb_transfer *t)
+{
+    struct sim_dev *d = t->dev_handle->dev;
+    struct sim_wire *w = &d->wire;
+
+    events_dev = d;
+    if (w->tail - w->head == w->cap) {
+        size_t cap = w->cap ? w->cap*2 : 64;
+        struct libusb_transfer **q = malloc(cap * sizeof (*q));
+        if (!q) {
+            return LIBUSB_ERROR_IO;
+        }
+        for (size_t i = w->head; i < w->tail; i++) {
+            q[i - w->head] = w->q[i % w->cap];
+        }
+        free(w->q);
+        w->q = q;
+        w->tail -= w->head;
+        w->head = 0;
+        w->cap = cap;
+    }
+    w->q[w->tail++ % w->cap] = t;
+    return 0;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *t)
+{
+    struct sim_wire *w = &t->dev_handle->dev->wire;
+
+    for (size_t i = w->head; i < w->tail; i++) {
+        if (w->q[i % w->cap] == t) {                                // Drop it and close the gap
+            for (size_t j = i; j + 1 < w->tail; j++) {
+                w->q[j % w->cap] = w->q[(j + 1) % w->cap];
+            }
+            w->tail--;
+            t->status = LIBUSB_TRANSFER_CANCELLED;
+            t->actual_length = 0;
+            t->callback(t);
+            return 0;
+        }
+    }
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_handle_events_completed(libusb_context *context, int *completed)
+{
+    struct sim_dev *d = events_dev;
+    struct sim_wire *w = d ? &d->wire : NULL;
+
+    (void)context;
+    if (!w || w->head == w->tail) {
+        return LIBUSB_ERROR_IO;                                     // Nothing would ever complete
+    }
+    while (w->head < w->tail && !(completed && *completed)) {
+        struct libusb_transfer *t = w->q[w->head++ % w->cap];
+        usb_process(d, t);
+        t->callback(t);
+    }
+    return 0;
+}
@@ -4,170 +4,157 @@
  * Copyright 2007-2022 Jianjun Jiang <8192542@qq.com>
  */
 
+#include <time.h>
+
 #include "spinand.h"
+#include "f1c100s.h"
+#include "pipeline.h"
+#include "session.h"
+#include "usb.h"
 
 
-struct spinand_info_t {
-    const char *name;
-    struct {
-        uint8_t val[4];
-        uint8_t len;
-    } id;
-    uint32_t page_size;
-    uint32_t spare_size;
-    uint32_t pages_per_block;
-    uint32_t blocks_per_die;
-    uint32_t planes_per_die;
-    uint32_t ndies;
-};
-
 struct spinand_pdata_t {
     struct spinand_info_t info;
     uint32_t swapbuf;
     uint32_t swaplen;
     uint32_t cmdlen;
-};
-
-enum {
-    OPCODE_RDID                 = 0x9f,
-    OPCODE_GET_FEATURE          = 0x0f,
-    OPCODE_SET_FEATURE          = 0x1f,
-    OPCODE_FEATURE_PROTECT      = 0xa0,
-    OPCODE_FEATURE_CONFIG       = 0xb0,
-    OPCODE_FEATURE_STATUS       = 0xc0,
-    OPCODE_READ_PAGE_TO_CACHE   = 0x13,
-    OPCODE_READ_PAGE_FROM_CACHE = 0x03,
-    OPCODE_WRITE_ENABLE         = 0x06,
-    OPCODE_BLOCK_ERASE          = 0xd8,
-    OPCODE_PROGRAM_LOAD         = 0x02,
-    OPCODE_PROGRAM_EXEC         = 0x10,
-    OPCODE_RESET                = 0xff,
+    int dual;                               // Page data read on both lines, OPCODE_READ_CACHE_X2
 };
 
 #define SPINAND_ID(...)  { .val = { __VA_ARGS__ }, .len = sizeof ((uint8_t[]){ __VA_ARGS__ }) }
 static const struct spinand_info_t spinand_infos[] = {
     /* Winbond */
-    { "W25N512GV",       SPINAND_ID(0xef, 0xaa, 0x20), 2048,  64,  64,  512, 1, 1 },
-    { "W25N01GV",        SPINAND_ID(0xef, 0xaa, 0x21), 2048,  64,  64, 1024, 1, 1 },
-    { "W25M02GV",        SPINAND_ID(0xef, 0xab, 0x21), 2048,  64,  64, 1024, 1, 2 },
-    { "W25N02KV",        SPINAND_ID(0xef, 0xaa, 0x22), 2048, 128,  64, 2048, 1, 1 },
+    { "W25N512GV",       SPINAND_ID(0xef, 0xaa, 0x20), 2048,  64,  64,  512, 1, 1, 0 },
+    { "W25N01GV",        SPINAND_ID(0xef, 0xaa, 0x21), 2048,  64,  64, 1024, 1, 1, 0 },
+    { "W25M02GV",        SPINAND_ID(0xef, 0xab, 0x21), 2048,  64,  64, 1024, 1, 2, 0 },
+    { "W25N02KV",        SPINAND_ID(0xef, 0xaa, 0x22), 2048, 128,  64, 2048, 1, 1, 0 },
 
     /* Gigadevice */
-    { "GD5F1GQ4UAWxx",   SPINAND_ID(0xc8, 0x10),       2048,  64,  64, 1024, 1, 1 },
-    { "GD5F1GQ5UExxG",   SPINAND_ID(0xc8, 0x51),       2048, 128,  64, 1024, 1, 1 },
-    { "GD5F1GQ4UExIG",   SPINAND_ID(0xc8, 0xd1),       2048, 128,  64, 1024, 1, 1 },
-    { "GD5F1GQ4UExxH",   SPINAND_ID(0xc8, 0xd9),       2048,  64,  64, 1024, 1, 1 },
-    { "GD5F1GQ4xAYIG",   SPINAND_ID(0xc8, 0xf1),       2048,  64,  64, 1024, 1, 1 },
-    { "GD5F2GQ4UExIG",   SPINAND_ID(0xc8, 0xd2),       2048, 128,  64, 2048, 1, 1 },
-    { "GD5F2GQ5UExxH",   SPINAND_ID(0xc8, 0x32),       2048,  64,  64, 2048, 1, 1 },
-    { "GD5F2GQ4xAYIG",   SPINAND_ID(0xc8, 0xf2),       2048,  64,  64, 2048, 1, 1 },
-    { "GD5F4GQ4UBxIG",   SPINAND_ID(0xc8, 0xd4),       4096, 256,  64, 2048, 1, 1 },
-    { "GD5F4GQ4xAYIG",   SPINAND_ID(0xc8, 0xf4),       2048,  64,  64, 4096, 1, 1 },
-    { "GD5F2GQ5UExxG",   SPINAND_ID(0xc8, 0x52),       2048, 128,  64, 2048, 1, 1 },
-    { "GD5F4GQ4UCxIG",   SPINAND_ID(0xc8, 0xb4),       4096, 256,  64, 2048, 1, 1 },
-    { "GD5F4GQ4RCxIG",   SPINAND_ID(0xc8, 0xa4),       4096, 256,  64, 2048, 1, 1 },
+    { "GD5F1GQ4UAWxx",   SPINAND_ID(0xc8, 0x10),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "GD5F1GQ5UExxG",   SPINAND_ID(0xc8, 0x51),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "GD5F1GQ4UExIG",   SPINAND_ID(0xc8, 0xd1),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "GD5F1GQ4UExxH",   SPINAND_ID(0xc8, 0xd9),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "GD5F1GQ4xAYIG",   SPINAND_ID(0xc8, 0xf1),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "GD5F2GQ4UExIG",   SPINAND_ID(0xc8, 0xd2),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "GD5F2GQ5UExxH",   SPINAND_ID(0xc8, 0x32),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "GD5F2GQ4xAYIG",   SPINAND_ID(0xc8, 0xf2),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "GD5F4GQ4UBxIG",   SPINAND_ID(0xc8, 0xd4),       4096, 256,  64, 2048, 1, 1, 0 },
+    { "GD5F4GQ4xAYIG",   SPINAND_ID(0xc8, 0xf4),       2048,  64,  64, 4096, 1, 1, 0 },
+    { "GD5F2GQ5UExxG",   SPINAND_ID(0xc8, 0x52),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "GD5F4GQ4UCxIG",   SPINAND_ID(0xc8, 0xb4),       4096, 256,  64, 2048, 1, 1, 0 },
+    { "GD5F4GQ4RCxIG",   SPINAND_ID(0xc8, 0xa4),       4096, 256,  64, 2048, 1, 1, 0 },
 
     /* Macronix */
-    { "MX35LF1GE4AB",    SPINAND_ID(0xc2, 0x12),       2048,  64,  64, 1024, 1, 1 },
-    { "MX35LF1G24AD",    SPINAND_ID(0xc2, 0x14),       2048, 128,  64, 1024, 1, 1 },
-    { "MX31LF1GE4BC",    SPINAND_ID(0xc2, 0x1e),       2048,  64,  64, 1024, 1, 1 },
-    { "MX35LF2GE4AB",    SPINAND_ID(0xc2, 0x22),       2048,  64,  64, 2048, 1, 1 },
-    { "MX35LF2G24AD",    SPINAND_ID(0xc2, 0x24),       2048, 128,  64, 2048, 1, 1 },
-    { "MX35LF2GE4AD",    SPINAND_ID(0xc2, 0x26),       2048, 128,  64, 2048, 1, 1 },
-    { "MX35LF2G14AC",    SPINAND_ID(0xc2, 0x20),       2048,  64,  64, 2048, 1, 1 },
-    { "MX35LF4G24AD",    SPINAND_ID(0xc2, 0x35),       4096, 256,  64, 2048, 1, 1 },
-    { "MX35LF4GE4AD",    SPINAND_ID(0xc2, 0x37),       4096, 256,  64, 2048, 1, 1 },
+    { "MX35LF1GE4AB",    SPINAND_ID(0xc2, 0x12),       2048,  64,  64, 1024, 1, 1, SPINAND_CACHE_READ },
+    { "MX35LF1G24AD",    SPINAND_ID(0xc2, 0x14),       2048, 128,  64, 1024, 1, 1, SPINAND_CACHE_READ },
+    { "MX31LF1GE4BC",    SPINAND_ID(0xc2, 0x1e),       2048,  64,  64, 1024, 1, 1, SPINAND_CACHE_READ },
+    { "MX35LF2GE4AB",    SPINAND_ID(0xc2, 0x22),       2048,  64,  64, 2048, 1, 1, SPINAND_CACHE_READ },
+    { "MX35LF2G24AD",    SPINAND_ID(0xc2, 0x24),       2048, 128,  64, 2048, 1, 1, SPINAND_CACHE_READ },
+    { "MX35LF2GE4AD",    SPINAND_ID(0xc2, 0x26),       2048, 128,  64, 2048, 1, 1, SPINAND_CACHE_READ },
+    { "MX35LF2G14AC",    SPINAND_ID(0xc2, 0x20),       2048,  64,  64, 2048, 1, 1, SPINAND_CACHE_READ },
+    { "MX35LF4G24AD",    SPINAND_ID(0xc2, 0x35),       4096, 256,  64, 2048, 1, 1, SPINAND_CACHE_READ },
+    { "MX35LF4GE4AD",    SPINAND_ID(0xc2, 0x37),       4096, 256,  64, 2048, 1, 1, SPINAND_CACHE_READ },
 
     /* Micron */
-    { "MT29F1G01AAADD",  SPINAND_ID(0x2c, 0x12),       2048,  64,  64, 1024, 1, 1 },
-    { "MT29F1G01ABAFD",  SPINAND_ID(0x2c, 0x14),       2048, 128,  64, 1024, 1, 1 },
-    { "MT29F2G01AAAED",  SPINAND_ID(0x2c, 0x9f),       2048,  64,  64, 2048, 2, 1 },
-    { "MT29F2G01ABAGD",  SPINAND_ID(0x2c, 0x24),       2048, 128,  64, 2048, 2, 1 },
-    { "MT29F4G01AAADD",  SPINAND_ID(0x2c, 0x32),       2048,  64,  64, 4096, 2, 1 },
-    { "MT29F4G01ABAFD",  SPINAND_ID(0x2c, 0x34),       4096, 256,  64, 2048, 1, 1 },
-    { "MT29F4G01ADAGD",  SPINAND_ID(0x2c, 0x36),       2048, 128,  64, 2048, 2, 2 },
-    { "MT29F8G01ADAFD",  SPINAND_ID(0x2c, 0x46),       4096, 256,  64, 2048, 1, 2 },
+    { "MT29F1G01AAADD",  SPINAND_ID(0x2c, 0x12),       2048,  64,  64, 1024, 1, 1, SPINAND_CACHE_READ },
+    { "MT29F1G01ABAFD",  SPINAND_ID(0x2c, 0x14),       2048, 128,  64, 1024, 1, 1, SPINAND_CACHE_READ },
+    { "MT29F2G01AAAED",  SPINAND_ID(0x2c, 0x9f),       2048,  64,  64, 2048, 2, 1, SPINAND_CACHE_READ },
+    { "MT29F2G01ABAGD",  SPINAND_ID(0x2c, 0x24),       2048, 128,  64, 2048, 2, 1, SPINAND_CACHE_READ },
+    { "MT29F4G01AAADD",  SPINAND_ID(0x2c, 0x32),       2048,  64,  64, 4096, 2, 1, SPINAND_CACHE_READ },
+    { "MT29F4G01ABAFD",  SPINAND_ID(0x2c, 0x34),       4096, 256,  64, 2048, 1, 1, SPINAND_CACHE_READ },
+    { "MT29F4G01ADAGD",  SPINAND_ID(0x2c, 0x36),       2048, 128,  64, 2048, 2, 2, SPINAND_CACHE_READ | SPINAND_DIE_FEATURE },
+    { "MT29F8G01ADAFD",  SPINAND_ID(0x2c, 0x46),       4096, 256,  64, 2048, 1, 2, SPINAND_CACHE_READ | SPINAND_DIE_FEATURE },
 
     /* Toshiba */
-    { "TC58CVG0S3HRAIG", SPINAND_ID(0x98, 0xc2),       2048, 128,  64, 1024, 1, 1 },
-    { "TC58CVG1S3HRAIG", SPINAND_ID(0x98, 0xcb),       2048, 128,  64, 2048, 1, 1 },
-    { "TC58CVG2S0HRAIG", SPINAND_ID(0x98, 0xcd),       4096, 256,  64, 2048, 1, 1 },
-    { "TC58CVG0S3HRAIJ", SPINAND_ID(0x98, 0xe2),       2048, 128,  64, 1024, 1, 1 },
-    { "TC58CVG1S3HRAIJ", SPINAND_ID(0x98, 0xeb),       2048, 128,  64, 2048, 1, 1 },
-    { "TC58CVG2S0HRAIJ", SPINAND_ID(0x98, 0xed),       4096, 256,  64, 2048, 1, 1 },
-    { "TH58CVG3S0HRAIJ", SPINAND_ID(0x98, 0xe4),       4096, 256,  64, 4096, 1, 1 },
+    { "TC58CVG0S3HRAIG", SPINAND_ID(0x98, 0xc2),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "TC58CVG1S3HRAIG", SPINAND_ID(0x98, 0xcb),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "TC58CVG2S0HRAIG", SPINAND_ID(0x98, 0xcd),       4096, 256,  64, 2048, 1, 1, 0 },
+    { "TC58CVG0S3HRAIJ", SPINAND_ID(0x98, 0xe2),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "TC58CVG1S3HRAIJ", SPINAND_ID(0x98, 0xeb),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "TC58CVG2S0HRAIJ", SPINAND_ID(0x98, 0xed),       4096, 256,  64, 2048, 1, 1, 0 },
+    { "TH58CVG3S0HRAIJ", SPINAND_ID(0x98, 0xe4),       4096, 256,  64, 4096, 1, 1, 0 },
 
     /* Esmt */
-    { "F50L512M41A",     SPINAND_ID(0xc8, 0x20),       2048,  64,  64,  512, 1, 1 },
-    { "F50L1G41A",       SPINAND_ID(0xc8, 0x21),       2048,  64,  64, 1024, 1, 1 },
-    { "F50L1G41LB",      SPINAND_ID(0xc8, 0x01),       2048,  64,  64, 1024, 1, 1 },
-    { "F50L2G41LB",      SPINAND_ID(0xc8, 0x0a),       2048,  64,  64, 1024, 1, 2 },
+    { "F50L512M41A",     SPINAND_ID(0xc8, 0x20),       2048,  64,  64,  512, 1, 1, 0 },
+    { "F50L1G41A",       SPINAND_ID(0xc8, 0x21),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "F50L1G41LB",      SPINAND_ID(0xc8, 0x01),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "F50L2G41LB",      SPINAND_ID(0xc8, 0x0a),       2048,  64,  64, 1024, 1, 2, 0 },
 
     /* Fison */
-    { "CS11G0T0A0AA",    SPINAND_ID(0x6b, 0x00),       2048, 128,  64, 1024, 1, 1 },
-    { "CS11G0G0A0AA",    SPINAND_ID(0x6b, 0x10),       2048, 128,  64, 1024, 1, 1 },
-    { "CS11G0S0A0AA",    SPINAND_ID(0x6b, 0x20),       2048,  64,  64, 1024, 1, 1 },
-    { "CS11G1T0A0AA",    SPINAND_ID(0x6b, 0x01),       2048, 128,  64, 2048, 1, 1 },
-    { "CS11G1S0A0AA",    SPINAND_ID(0x6b, 0x21),       2048,  64,  64, 2048, 1, 1 },
-    { "CS11G2T0A0AA",    SPINAND_ID(0x6b, 0x02),       2048, 128,  64, 4096, 1, 1 },
-    { "CS11G2S0A0AA",    SPINAND_ID(0x6b, 0x22),       2048,  64,  64, 4096, 1, 1 },
+    { "CS11G0T0A0AA",    SPINAND_ID(0x6b, 0x00),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "CS11G0G0A0AA",    SPINAND_ID(0x6b, 0x10),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "CS11G0S0A0AA",    SPINAND_ID(0x6b, 0x20),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "CS11G1T0A0AA",    SPINAND_ID(0x6b, 0x01),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "CS11G1S0A0AA",    SPINAND_ID(0x6b, 0x21),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "CS11G2T0A0AA",    SPINAND_ID(0x6b, 0x02),       2048, 128,  64, 4096, 1, 1, 0 },
+    { "CS11G2S0A0AA",    SPINAND_ID(0x6b, 0x22),       2048,  64,  64, 4096, 1, 1, 0 },
 
     /* Etron */
-    { "EM73B044VCA",     SPINAND_ID(0xd5, 0x01),       2048,  64,  64,  512, 1, 1 },
-    { "EM73C044SNB",     SPINAND_ID(0xd5, 0x11),       2048, 120,  64, 1024, 1, 1 },
-    { "EM73C044SNF",     SPINAND_ID(0xd5, 0x09),       2048, 128,  64, 1024, 1, 1 },
-    { "EM73C044VCA",     SPINAND_ID(0xd5, 0x18),       2048,  64,  64, 1024, 1, 1 },
-    { "EM73C044SNA",     SPINAND_ID(0xd5, 0x19),       2048,  64, 128,  512, 1, 1 },
-    { "EM73C044VCD",     SPINAND_ID(0xd5, 0x1c),       2048,  64,  64, 1024, 1, 1 },
-    { "EM73C044SND",     SPINAND_ID(0xd5, 0x1d),       2048,  64,  64, 1024, 1, 1 },
-    { "EM73D044SND",     SPINAND_ID(0xd5, 0x1e),       2048,  64,  64, 2048, 1, 1 },
-    { "EM73C044VCC",     SPINAND_ID(0xd5, 0x22),       2048,  64,  64, 1024, 1, 1 },
-    { "EM73C044VCF",     SPINAND_ID(0xd5, 0x25),       2048,  64,  64, 1024, 1, 1 },
-    { "EM73C044SNC",     SPINAND_ID(0xd5, 0x31),       2048, 128,  64, 1024, 1, 1 },
-    { "EM73D044SNC",     SPINAND_ID(0xd5, 0x0a),       2048, 120,  64, 2048, 1, 1 },
-    { "EM73D044SNA",     SPINAND_ID(0xd5, 0x12),       2048, 128,  64, 2048, 1, 1 },
-    { "EM73D044SNF",     SPINAND_ID(0xd5, 0x10),       2048, 128,  64, 2048, 1, 1 },
-    { "EM73D044VCA",     SPINAND_ID(0xd5, 0x13),       2048, 128,  64, 2048, 1, 1 },
-    { "EM73D044VCB",     SPINAND_ID(0xd5, 0x14),       2048,  64,  64, 2048, 1, 1 },
-    { "EM73D044VCD",     SPINAND_ID(0xd5, 0x17),       2048, 128,  64, 2048, 1, 1 },
-    { "EM73D044VCH",     SPINAND_ID(0xd5, 0x1b),       2048,  64,  64, 2048, 1, 1 },
-    { "EM73D044SND",     SPINAND_ID(0xd5, 0x1d),       2048,  64,  64, 2048, 1, 1 },
-    { "EM73D044VCG",     SPINAND_ID(0xd5, 0x1f),       2048,  64,  64, 2048, 1, 1 },
-    { "EM73D044VCE",     SPINAND_ID(0xd5, 0x20),       2048,  64,  64, 2048, 1, 1 },
-    { "EM73D044VCL",     SPINAND_ID(0xd5, 0x2e),       2048, 128,  64, 2048, 1, 1 },
-    { "EM73D044SNB",     SPINAND_ID(0xd5, 0x32),       2048, 128,  64, 2048, 1, 1 },
-    { "EM73E044SNA",     SPINAND_ID(0xd5, 0x03),       4096, 256,  64, 2048, 1, 1 },
-    { "EM73E044SND",     SPINAND_ID(0xd5, 0x0b),       4096, 240,  64, 2048, 1, 1 },
-    { "EM73E044SNB",     SPINAND_ID(0xd5, 0x23),       4096, 256,  64, 2048, 1, 1 },
-    { "EM73E044VCA",     SPINAND_ID(0xd5, 0x2c),       4096, 256,  64, 2048, 1, 1 },
-    { "EM73E044VCB",     SPINAND_ID(0xd5, 0x2f),       2048, 128,  64, 4096, 1, 1 },
-    { "EM73F044SNA",     SPINAND_ID(0xd5, 0x24),       4096, 256,  64, 4096, 1, 1 },
-    { "EM73F044VCA",     SPINAND_ID(0xd5, 0x2d),       4096, 256,  64, 4096, 1, 1 },
-    { "EM73E044SNE",     SPINAND_ID(0xd5, 0x0e),       4096, 256,  64, 4096, 1, 1 },
-    { "EM73C044SNG",     SPINAND_ID(0xd5, 0x0c),       2048, 120,  64, 1024, 1, 1 },
-    { "EM73D044VCN",     SPINAND_ID(0xd5, 0x0f),       2048,  64,  64, 2048, 1, 1 },
+    { "EM73B044VCA",     SPINAND_ID(0xd5, 0x01),       2048,  64,  64,  512, 1, 1, 0 },
+    { "EM73C044SNB",     SPINAND_ID(0xd5, 0x11),       2048, 120,  64, 1024, 1, 1, 0 },
+    { "EM73C044SNF",     SPINAND_ID(0xd5, 0x09),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "EM73C044VCA",     SPINAND_ID(0xd5, 0x18),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "EM73C044SNA",     SPINAND_ID(0xd5, 0x19),       2048,  64, 128,  512, 1, 1, 0 },
+    { "EM73C044VCD",     SPINAND_ID(0xd5, 0x1c),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "EM73C044SND",     SPINAND_ID(0xd5, 0x1d),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "EM73D044SND",     SPINAND_ID(0xd5, 0x1e),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "EM73C044VCC",     SPINAND_ID(0xd5, 0x22),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "EM73C044VCF",     SPINAND_ID(0xd5, 0x25),       2048,  64,  64, 1024, 1, 1, 0 },
+    { "EM73C044SNC",     SPINAND_ID(0xd5, 0x31),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "EM73D044SNC",     SPINAND_ID(0xd5, 0x0a),       2048, 120,  64, 2048, 1, 1, 0 },
+    { "EM73D044SNA",     SPINAND_ID(0xd5, 0x12),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "EM73D044SNF",     SPINAND_ID(0xd5, 0x10),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "EM73D044VCA",     SPINAND_ID(0xd5, 0x13),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "EM73D044VCB",     SPINAND_ID(0xd5, 0x14),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "EM73D044VCD",     SPINAND_ID(0xd5, 0x17),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "EM73D044VCH",     SPINAND_ID(0xd5, 0x1b),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "EM73D044SND",     SPINAND_ID(0xd5, 0x1d),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "EM73D044VCG",     SPINAND_ID(0xd5, 0x1f),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "EM73D044VCE",     SPINAND_ID(0xd5, 0x20),       2048,  64,  64, 2048, 1, 1, 0 },
+    { "EM73D044VCL",     SPINAND_ID(0xd5, 0x2e),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "EM73D044SNB",     SPINAND_ID(0xd5, 0x32),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "EM73E044SNA",     SPINAND_ID(0xd5, 0x03),       4096, 256,  64, 2048, 1, 1, 0 },
+    { "EM73E044SND",     SPINAND_ID(0xd5, 0x0b),       4096, 240,  64, 2048, 1, 1, 0 },
+    { "EM73E044SNB",     SPINAND_ID(0xd5, 0x23),       4096, 256,  64, 2048, 1, 1, 0 },
+    { "EM73E044VCA",     SPINAND_ID(0xd5, 0x2c),       4096, 256,  64, 2048, 1, 1, 0 },
+    { "EM73E044VCB",     SPINAND_ID(0xd5, 0x2f),       2048, 128,  64, 4096, 1, 1, 0 },
+    { "EM73F044SNA",     SPINAND_ID(0xd5, 0x24),       4096, 256,  64, 4096, 1, 1, 0 },
+    { "EM73F044VCA",     SPINAND_ID(0xd5, 0x2d),       4096, 256,  64, 4096, 1, 1, 0 },
+    { "EM73E044SNE",     SPINAND_ID(0xd5, 0x0e),       4096, 256,  64, 4096, 1, 1, 0 },
+    { "EM73C044SNG",     SPINAND_ID(0xd5, 0x0c),       2048, 120,  64, 1024, 1, 1, 0 },
+    { "EM73D044VCN",     SPINAND_ID(0xd5, 0x0f),       2048,  64,  64, 2048, 1, 1, 0 },
 
     /* Elnec */
-    { "FM35Q1GA",        SPINAND_ID(0xe5, 0x71),       2048,  64,  64, 1024, 1, 1 },
+    { "FM35Q1GA",        SPINAND_ID(0xe5, 0x71),       2048,  64,  64, 1024, 1, 1, 0 },
 
     /* Paragon */
-    { "PN26G01A",        SPINAND_ID(0xa1, 0xe1),       2048, 128,  64, 1024, 1, 1 },
-    { "PN26G02A",        SPINAND_ID(0xa1, 0xe2),       2048, 128,  64, 2048, 1, 1 },
+    { "PN26G01A",        SPINAND_ID(0xa1, 0xe1),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "PN26G02A",        SPINAND_ID(0xa1, 0xe2),       2048, 128,  64, 2048, 1, 1, 0 },
 
     /* Ato */
-    { "ATO25D1GA",       SPINAND_ID(0x9b, 0x12),       2048,  64,  64, 1024, 1, 1 },
+    { "ATO25D1GA",       SPINAND_ID(0x9b, 0x12),       2048,  64,  64, 1024, 1, 1, 0 },
 
     /* Heyang */
-    { "HYF1GQ4U",        SPINAND_ID(0xc9, 0x51),       2048, 128,  64, 1024, 1, 1 },
-    { "HYF2GQ4U",        SPINAND_ID(0xc9, 0x52),       2048, 128,  64, 2048, 1, 1 },
-    { "HYF4GQ4U",        SPINAND_ID(0xc9, 0x54),       2048, 128,  64, 4096, 1, 1 },
+    { "HYF1GQ4U",        SPINAND_ID(0xc9, 0x51),       2048, 128,  64, 1024, 1, 1, 0 },
+    { "HYF2GQ4U",        SPINAND_ID(0xc9, 0x52),       2048, 128,  64, 2048, 1, 1, 0 },
+    { "HYF4GQ4U",        SPINAND_ID(0xc9, 0x54),       2048, 128,  64, 4096, 1, 1, 0 },
 
     /* FORESEE */
-    { "F35SQA001G",      SPINAND_ID(0xCD, 0x71, 0x71), 2048,  64,  64, 1024, 1, 1 },
-    { "F35SQA002G",      SPINAND_ID(0xCD, 0x72, 0x72), 2048,  64,  64, 2048, 1, 1 },
+    { "F35SQA001G",      SPINAND_ID(0xCD, 0x71, 0x71), 2048,  64,  64, 1024, 1, 1, 0 },
+    { "F35SQA002G",      SPINAND_ID(0xCD, 0x72, 0x72), 2048,  64,  64, 2048, 1, 1, 0 },
 };
 
 
+const struct spinand_info_t * spinand_lookup(const char *name)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(spinand_infos); i++) {
+        if (strcmp(spinand_infos[i].name, name) == 0) {
+            return &spinand_infos[i];
+        }
+    }
+    return NULL;
+}
+
 static int spinand_info(struct xfel_ctx_t *ctx, struct spinand_pdata_t *pdat)
 {
     uint8_t tx[2] = { [0] = OPCODE_RDID, [1] = 0x0 };
@@ -251,15 +238,48 @@ static int spinand_wait_for_busy(struct xfel_ctx_t *ctx, struct spinand_pdata_t
     return 0;
 }
 
-static int spinand_helper_init(struct xfel_ctx_t *ctx, struct spinand_pdata_t *pdat, int unlock)
+// Set to anything but empty or 0
+static int env_on(const char *name)
 {
-    if (!(fel_spi_init(ctx, &pdat->swapbuf, &pdat->swaplen, &pdat->cmdlen) && spinand_info(ctx, pdat))) {
-        return 0;
+    const char *v = getenv(name);
+    return v && *v && strcmp(v, "0") != 0;
+}
+
+// SPI_CMD_INIT puts back SPI_CCR_DEFAULT on every fel_spi_init()
+static void spi_clock_set(struct xfel_ctx_t *ctx, struct session_t *s)
+{
+    const char *mhz = getenv("DSOFLASH_SPI_CLOCK");
+    uint32_t ccr = s ? s->spi_ccr : 0;
+
+    if (!ccr && mhz && *mhz) {
+        uint32_t ahb = f1c100s_ahb_hz(ctx);
+        ccr = f1c100s_spi_ccr(ahb, (uint32_t)(strtod(mhz, NULL) * 1e6 + 0.5));
+        printf("SPI clock %.2f MHz (AHB %.2f MHz / %u)\n", f1c100s_spi_hz(ahb, ccr) / 1e6, ahb / 1e6, 2 * ((ccr & 0xff) + 1));
+        if (s) {
+            s->spi_ccr = ccr;
+        }
     }
+    if (ccr && ccr != SPI_CCR_DEFAULT) {
+        fel_write32(ctx, SPI0_CCR, ccr);
+    }
+}
 
-    spinand_reset(ctx, pdat);
-    spinand_wait_for_busy(ctx, pdat);
+// Single transfers (ID, features) go to the selected die, die 0 after power up
+static int spinand_die_select(struct xfel_ctx_t *ctx, struct spinand_pdata_t *pdat, uint32_t die)
+{
+    if (pdat->info.ndies < 2) {
+        return 1;
+    }
+    if (pdat->info.flags & SPINAND_DIE_FEATURE) {
+        return spinand_set_feature(ctx, pdat, OPCODE_FEATURE_DIE, die << 6);
+    }
+    uint8_t tx[2] = { OPCODE_DIE_SELECT, die };
+    return fel_spi_xfer(ctx, pdat->swapbuf, pdat->swaplen, pdat->cmdlen, tx, sizeof (tx), 0, 0);
+}
 
+// Protection, when asked to clear it, and ECC are per die
+static int spinand_die_setup(struct xfel_ctx_t *ctx, struct spinand_pdata_t *pdat, int unlock)
+{
     uint8_t val;
 
     if (unlock) {
@@ -317,7 +337,45 @@ static int spinand_helper_init(struct xfel_ctx_t *ctx, struct spinand_pdata_t *p
     }
 
     spinand_wait_for_busy(ctx, pdat);
+    return 1;
+}
+
+static int spinand_helper_init(struct xfel_ctx_t *ctx, struct spinand_pdata_t *pdat, int unlock)
+{
+    struct session_t *s = session_get(ctx);
 
+    if (!fel_spi_init(ctx, &pdat->swapbuf, &pdat->swaplen, &pdat->cmdlen)) {
+        return 0;
+    }
+    spi_clock_set(ctx, s);
+    pdat->dual = env_on("DSOFLASH_SPI_DUAL") || (s && s->spi_dual);     // Only where the board is known to read back right
+    if (s && s->flash) {                                                // Set up by an earlier operation, no reset needed
+        memcpy(&pdat->info, &s->info, sizeof pdat->info);
+        if (!unlock || s->unlocked) {
+            return 1;
+        }
+    } else {
+        if (!spinand_info(ctx, pdat)) {
+            return 0;
+        }
+        for (uint32_t die = 0; die < pdat->info.ndies; die++) {             // A reset only reaches the selected die
+            spinand_die_select(ctx, pdat, die);
+            spinand_reset(ctx, pdat);
+            spinand_wait_for_busy(ctx, pdat);
+        }
+    }
+
+    for (uint32_t die = pdat->info.ndies; die-- > 0;) {                 // Ends on die 0, where single transfers go
+        if (!spinand_die_select(ctx, pdat, die) || !spinand_die_setup(ctx, pdat, unlock)) {
+            return 0;
+        }
+    }
+
+    if (s) {
+        memcpy(&s->info, &pdat->info, sizeof s->info);
+        s->flash = 1;
+        s->unlocked |= unlock;
+    }
     return 1;
 }
 
@@ -333,69 +391,405 @@ int spinand_detect(struct xfel_ctx_t *ctx, char *name, size_t *capacity)
         strcpy(name, pdat.info.name);
     }
     if (capacity) {
-        *capacity = (size_t)pdat.info.page_size * pdat.info.pages_per_block * pdat.info.blocks_per_die * pdat.info.ndies;
+        *capacity = (size_t)pdat.info.page_size * spinand_pages(&pdat.info);
     }
     return 1;
 }
 
-int dso2d_erase(struct xfel_ctx_t *ctx)
+enum { ERASE_CMD_SZ = 16U, WAIT_CMD_SZ = 3U, DIE_CMD_SZ = 7U };
+
+// Row address of page within its die, 24 bits on the wire
+static uint32_t page_row(const struct spinand_info_t *info, uint32_t page)
 {
-    enum { ERASE_CMD_SZ  = 64U };
+    return page % (info->pages_per_block * info->blocks_per_die);
+}
 
-    struct progress_t p;
+static uint32_t page_die(const struct spinand_info_t *info, uint32_t page)
+{
+    return page / (info->pages_per_block * info->blocks_per_die);
+}
+
+// Column of the first byte of page: on two plane dies odd blocks are in the
+// second plane, picked by the column bit above the page and its spare area
+static uint32_t page_column(const struct spinand_info_t *info, uint32_t page)
+{
+    return (page / info->pages_per_block) % info->planes_per_die * (info->page_size * 2);
+}
+
+// Select die for the commands that follow unless *cur already is it; *cur is
+// -1 at the start of a command list, the die left selected isn't known
+static uint8_t * cmd_die_select(uint8_t *d, const struct spinand_info_t *info, uint32_t die, int *cur)
+{
+    if (info->ndies < 2 || *cur == (int)die) {
+        return d;
+    }
+    *cur = die;
+    *d++ = SPI_CMD_SELECT;
+    *d++ = SPI_CMD_FAST;
+    if (info->flags & SPINAND_DIE_FEATURE) {
+        *d++ = 3;
+        *d++ = OPCODE_SET_FEATURE;
+        *d++ = OPCODE_FEATURE_DIE;
+        *d++ = die << 6;
+    } else {
+        *d++ = 2;
+        *d++ = OPCODE_DIE_SELECT;
+        *d++ = die;
+    }
+    *d++ = SPI_CMD_DESELECT;
+    return d;
+}
+
+static uint8_t * cmd_wait(uint8_t *d)
+{
+    d[0] = SPI_CMD_SELECT;
+    d[1] = SPI_CMD_SPINAND_WAIT;
+    d[2] = SPI_CMD_DESELECT;
+    return d + WAIT_CMD_SZ;
+}
+
+// Ends with a busy wait, ERASE_CMD_SZ - WAIT_CMD_SZ bytes leave it out
+static void cmd_block_erase(uint8_t *d, uint32_t row)
+{
+    d[0]  = SPI_CMD_SELECT;                 // Write enable
+    d[1]  = SPI_CMD_FAST;
+    d[2]  = 1;
+    d[3]  = OPCODE_WRITE_ENABLE;
+    d[4]  = SPI_CMD_DESELECT;
+    d[5]  = SPI_CMD_SELECT;
+    d[6]  = SPI_CMD_FAST;
+    d[7]  = 4;
+    d[8]  = OPCODE_BLOCK_ERASE;             // Erase block
+    d[9]  = (row>>16) & 0xFF;               // Row address of a page in the block
+    d[10] = (row>>8)  & 0xFF;
+    d[11] = (row>>0)  & 0xFF;
+    d[12] = SPI_CMD_DESELECT;
+    d[13] = SPI_CMD_SELECT;                 // Check busy
+    d[14] = SPI_CMD_SPINAND_WAIT;
+    d[15] = SPI_CMD_DESELECT;
+}
+
+enum {
+    READ_CMD_SZ    = 28U,                   // Also the most cmd_pages_read() takes per page
+    CRC_CMD_SZ     = 13U,
+    PACK_CMD_SZ    = 17U,
+    CACHE_READ_MIN = 4U,                    // Shorter cache read runs would take more cmd space than plain reads
+};
+
+static void cmd_page_read(uint8_t *d, uint32_t row, uint32_t col, uint32_t dst, uint32_t len, int dual)
+{
+    d[0]  = SPI_CMD_SELECT;
+    d[1]  = SPI_CMD_FAST;
+    d[2]  = 4;
+    d[3]  = OPCODE_READ_PAGE_TO_CACHE;      // Load page into buffer
+    d[4]  = (row>>16) & 0xFF;               // Row address of the page to read
+    d[5]  = (row>>8)  & 0xFF;
+    d[6]  = (row>>0)  & 0xFF;
+    d[7]  = SPI_CMD_DESELECT;
+    d[8]  = SPI_CMD_SELECT;
+    d[9]  = SPI_CMD_SPINAND_WAIT;           // Check Busy flag
+    d[10] = SPI_CMD_DESELECT;
+    d[11] = SPI_CMD_SELECT;
+    d[12] = SPI_CMD_FAST;
+    d[13] = 4;
+    d[14] = dual ? OPCODE_READ_CACHE_X2 : OPCODE_READ_PAGE_FROM_CACHE;     // Read data from buffer
+    d[15] = (col>>8) & 0xFF;                // Column address H, with the plane
+    d[16] = (col>>0) & 0xFF;                // Column address L
+    d[17] = 0;                              // Dummy
+    d[18] = dual ? SPI_CMD_RXBUF_DUAL : SPI_CMD_RXBUF;                      // Receive data into SDRAM
+    d[19] = (dst>>0)  & 0xFF;               // Dest address
+    d[20] = (dst>>8)  & 0xFF;
+    d[21] = (dst>>16) & 0xFF;
+    d[22] = (dst>>24) & 0xFF;
+    d[23] = (len>>0)  & 0xFF;               // Rx length
+    d[24] = (len>>8)  & 0xFF;
+    d[25] = (len>>16) & 0xFF;
+    d[26] = (len>>24) & 0xFF;
+    d[27] = SPI_CMD_DESELECT;
+}
+
+// Pages page..page+n-1 of one block through the cache: after the first page
+// read, every 0x31 moves the next page to the cache and starts loading the one
+// after it, so the array is read while the previous page is clocked out and tR
+// is waited for once per run. 0x3f takes the last page without loading another.
+static uint32_t cmd_cache_read(uint8_t *d, uint32_t row, uint32_t col, uint32_t n, uint32_t dst, uint32_t len, int dual)
+{
+    uint8_t *p = d;
+
+    *p++ = SPI_CMD_SELECT;
+    *p++ = SPI_CMD_FAST;
+    *p++ = 4;
+    *p++ = OPCODE_READ_PAGE_TO_CACHE;       // Load first page
+    *p++ = (row>>16) & 0xFF;                // Row address of the page to read
+    *p++ = (row>>8)  & 0xFF;
+    *p++ = (row>>0)  & 0xFF;
+    *p++ = SPI_CMD_DESELECT;
+    *p++ = SPI_CMD_SELECT;
+    *p++ = SPI_CMD_SPINAND_WAIT;
+    *p++ = SPI_CMD_DESELECT;
+    for (uint32_t i = 0; i < n; i++, dst += len) {
+        *p++ = SPI_CMD_SELECT;
+        *p++ = SPI_CMD_FAST;
+        *p++ = 1;
+        *p++ = (i + 1 < n) ? OPCODE_READ_CACHE_SEQ : OPCODE_READ_CACHE_END;
+        *p++ = SPI_CMD_DESELECT;
+        *p++ = SPI_CMD_SELECT;
+        *p++ = SPI_CMD_SPINAND_WAIT;        // Until the page is in the cache
+        *p++ = SPI_CMD_DESELECT;
+        *p++ = SPI_CMD_SELECT;
+        *p++ = SPI_CMD_FAST;
+        *p++ = 4;
+        *p++ = dual ? OPCODE_READ_CACHE_X2 : OPCODE_READ_PAGE_FROM_CACHE;
+        *p++ = (col>>8) & 0xFF;             // Column address H, all pages of a block are in one plane
+        *p++ = (col>>0) & 0xFF;             // Column address L
+        *p++ = 0;                           // Dummy
+        *p++ = dual ? SPI_CMD_RXBUF_DUAL : SPI_CMD_RXBUF;
+        *p++ = (dst>>0)  & 0xFF;            // Dest address
+        *p++ = (dst>>8)  & 0xFF;
+        *p++ = (dst>>16) & 0xFF;
+        *p++ = (dst>>24) & 0xFF;
+        *p++ = (len>>0)  & 0xFF;            // Rx length
+        *p++ = (len>>8)  & 0xFF;
+        *p++ = (len>>16) & 0xFF;
+        *p++ = (len>>24) & 0xFF;
+        *p++ = SPI_CMD_DESELECT;
+    }
+    return p - d;
+}
+
+// Read n pages from page on into SDRAM from dst on, back to back; cache reads
+// where the chip has them, never across a block. On stacked dies a die select
+// comes first and wherever the die changes. Returns the cmd length.
+static uint32_t cmd_pages_read(uint8_t *d, const struct spinand_pdata_t *pdat, uint32_t page, uint32_t n, uint32_t dst)
+{
+    const struct spinand_info_t *info = &pdat->info;
+    uint32_t len = info->page_size, ppb = info->pages_per_block, off = 0;
+    int die = -1;
+
+    while (n > 0) {
+        uint32_t run = ppb - page % ppb;
+        if (run > n) {
+            run = n;
+        }
+        uint32_t row = page_row(info, page), col = page_column(info, page);
+        off = cmd_die_select(&d[off], info, page_die(info, page), &die) - d;
+        if ((info->flags & SPINAND_CACHE_READ) && run >= CACHE_READ_MIN) {
+            off += cmd_cache_read(&d[off], row, col, run, dst, len, pdat->dual);
+        } else {
+            for (uint32_t i = 0; i < run; i++, off += READ_CMD_SZ) {
+                cmd_page_read(&d[off], row + i, col, dst + i*len, len, pdat->dual);
+            }
+        }
+        page += run;
+        dst += run*len;
+        n -= run;
+    }
+    return off;
+}
+
+// Computed by the payload itself, see chip_spi_init()
+static void cmd_crc32(uint8_t *d, uint32_t src, uint32_t len, uint32_t dst)
+{
+    d[0]  = SPI_CMD_CRC32;
+    d[1]  = (src>>0)  & 0xFF;               // Data address
+    d[2]  = (src>>8)  & 0xFF;
+    d[3]  = (src>>16) & 0xFF;
+    d[4]  = (src>>24) & 0xFF;
+    d[5]  = (len>>0)  & 0xFF;               // Data length
+    d[6]  = (len>>8)  & 0xFF;
+    d[7]  = (len>>16) & 0xFF;
+    d[8]  = (len>>24) & 0xFF;
+    d[9]  = (dst>>0)  & 0xFF;               // Where the CRC word is stored
+    d[10] = (dst>>8)  & 0xFF;
+    d[11] = (dst>>16) & 0xFF;
+    d[12] = (dst>>24) & 0xFF;
+}
+
+static void cmd_pack(uint8_t *d, uint32_t addr, uint32_t page_size, uint32_t pages, uint32_t map)
+{
+    d[0]  = SPI_CMD_PACK;
+    d[1]  = (addr>>0)       & 0xFF;         // Pages address
+    d[2]  = (addr>>8)       & 0xFF;
+    d[3]  = (addr>>16)      & 0xFF;
+    d[4]  = (addr>>24)      & 0xFF;
+    d[5]  = (page_size>>0)  & 0xFF;         // Page size
+    d[6]  = (page_size>>8)  & 0xFF;
+    d[7]  = (page_size>>16) & 0xFF;
+    d[8]  = (page_size>>24) & 0xFF;
+    d[9]  = (pages>>0)      & 0xFF;         // Page count
+    d[10] = (pages>>8)      & 0xFF;
+    d[11] = (pages>>16)     & 0xFF;
+    d[12] = (pages>>24)     & 0xFF;
+    d[13] = (map>>0)        & 0xFF;         // Where the data page count and bitmap go
+    d[14] = (map>>8)        & 0xFF;
+    d[15] = (map>>16)       & 0xFF;
+    d[16] = (map>>24)       & 0xFF;
+}
+
+static int block_selected(const uint8_t *blocks, uint32_t block)
+{
+    return !blocks || ((blocks[block / 8] >> (block % 8)) & 1);
+}
+
+static __thread dso2d_progress_t progress_cb;
+static __thread void *progress_arg;
+
+void dso2d_set_progress(dso2d_progress_t cb, void *arg)
+{
+    progress_cb = cb;
+    progress_arg = arg;
+}
+
+struct op_progress_t {
+    struct progress_t bar;
+    const char *what;
+};
+
+static void op_progress_start(struct op_progress_t *p, const char *what, uint64_t total)
+{
+    p->what = what;
+    if (progress_cb) {
+        p->bar.total = total;
+        p->bar.done = 0;
+        progress_cb(progress_arg, what, 0, total);
+    } else {
+        printf("\n%s...\n", what);
+        progress_start(&p->bar, total);
+    }
+}
+
+static void op_progress_update(struct op_progress_t *p, uint64_t bytes)
+{
+    if (progress_cb) {
+        p->bar.done += bytes;
+        progress_cb(progress_arg, p->what, p->bar.done, p->bar.total);
+    } else {
+        progress_update(&p->bar, bytes);
+    }
+}
+
+static void op_progress_stop(struct op_progress_t *p)
+{
+    if (!progress_cb) {
+        progress_stop(&p->bar);
+    }
+}
+
+// Every die done with whatever the command list started on it
+static uint8_t * cmd_wait_dies(uint8_t *d, const struct spinand_info_t *info, int *die)
+{
+    for (uint32_t i = 0; i < info->ndies; i++) {
+        d = cmd_wait(cmd_die_select(d, info, i, die));
+    }
+    return d;
+}
+
+// Block j of the erase and program order: on stacked dies the dies take turns,
+// so one die erases or programs while the next one's commands go out
+static uint32_t die_turn(const struct spinand_info_t *info, uint32_t j, uint32_t per_die)
+{
+    return (j % info->ndies) * per_die + j / info->ndies;
+}
+
+int dso2d_erase(struct xfel_ctx_t *ctx, const uint8_t *blocks)
+{
+    enum { ERASE_BATCH = 64U };
+
+    struct op_progress_t p;
     struct spinand_pdata_t pdat;
-    uint8_t cbuf[(ERASE_CMD_SZ*16)+1];
-
-    for (size_t i = 0; i < ERASE_CMD_SZ; ++i) { // Make a large cmd queue to reduce overhead
-        uint8_t *d = &cbuf[16*i];
-        d[0]  = SPI_CMD_SELECT;                 // Write enable
-        d[1]  = SPI_CMD_FAST;
-        d[2]  = 1;
-        d[3]  = OPCODE_WRITE_ENABLE;
-        d[4]  = SPI_CMD_DESELECT;
-        d[5]  = SPI_CMD_SELECT;
-        d[6]  = SPI_CMD_FAST;
-        d[7]  = 4;
-        d[8]  = OPCODE_BLOCK_ERASE;             // Erase block
-        d[9]  = 0;                              // Dummy
-        d[10] = 0;                              // Block address
-        d[11] = 0;
-        d[12] = SPI_CMD_DESELECT;
-        d[13] = SPI_CMD_SELECT;                 // Check busy
-        d[14] = SPI_CMD_SPINAND_WAIT;
-        d[15] = SPI_CMD_DESELECT;
-    }
-    cbuf[16*ERASE_CMD_SZ] = SPI_CMD_END;        // Done
+    uint8_t cbuf[(ERASE_BATCH*(DIE_CMD_SZ + WAIT_CMD_SZ + ERASE_CMD_SZ)) + (SPINAND_DIES_MAX*(DIE_CMD_SZ + WAIT_CMD_SZ)) + 1];
 
     if (!spinand_helper_init(ctx, &pdat, 1) || sizeof (cbuf) > pdat.cmdlen ) {
         return 0;
     }
 
-    uint32_t pages, page = 0, n = pdat.info.page_size;
+    const struct spinand_info_t *info = &pdat.info;
+    uint32_t n = info->page_size, ppb = info->pages_per_block;
+    uint32_t nblocks = info->blocks_per_die * info->ndies, j = 0;
+
+    op_progress_start(&p, "Erasing flash", (uint64_t)nblocks*ppb*n);
+    while (j < nblocks) {
+        uint32_t i = 0, first = j;
+        uint8_t *c = cbuf;
+        int die = -1;
+        for (; i < ERASE_BATCH && j < nblocks; j++) {                   // Make a large cmd queue to reduce overhead
+            uint32_t block = die_turn(info, j, info->blocks_per_die);
+            if (!block_selected(blocks, block)) {
+                continue;
+            }
+            c = cmd_die_select(c, info, page_die(info, block*ppb), &die);
+            if (info->ndies > 1) {                                      // Wait for this die's previous erase only
+                c = cmd_wait(c);
+                cmd_block_erase(c, page_row(info, block*ppb));
+                c += ERASE_CMD_SZ - WAIT_CMD_SZ;
+            } else {
+                cmd_block_erase(c, page_row(info, block*ppb));
+                c += ERASE_CMD_SZ;
+            }
+            i++;
+        }
+        if (i) {
+            if (info->ndies > 1) {
+                c = cmd_wait_dies(c, info, &die);
+            }
+            *c++ = SPI_CMD_END;
+            if (!fel_chip_spi_run(ctx, cbuf, c - cbuf)) {               // Run Command buffer
+                return 0;
+            }
+        }
+        op_progress_update(&p, (uint64_t)(j - first)*ppb*n);
+    }
+    op_progress_stop(&p);
+    return 1;
+}
 
-    printf("\nErasing flash...\n");
-    pages = pdat.info.pages_per_block * pdat.info.blocks_per_die * pdat.info.ndies * pdat.info.planes_per_die;
-    progress_start(&p, pages*n);
-    while (page < pages) {
-        for (size_t i = 0; i < ERASE_CMD_SZ; i++) { // Make a large cmd queue to reduce overhead
-            uint8_t *d = &cbuf[16*i];
-            d[10] = (page>>8) & 0xFF;                              // Block address
-            d[11] = (page>>0) & 0xFF;
-            page += pdat.info.pages_per_block;
+struct dump_sink_t {
+    dso2d_sink_t sink;
+    void *arg;
+    uint32_t page_size;
+};
+
+// The packed pages are followed in the slot by the map SPI_CMD_PACK wrote. Runs
+// of data pages go to the sink straight from the packed area, runs of erased
+// pages as NULL data.
+static int dump_drain(void *arg, struct pipeline_slot *s)
+{
+    struct dump_sink_t *ds = arg;
+    const uint8_t *map = &s->buf[s->len], *p = s->buf;
+    uint32_t used = map[0] | (map[1] << 8) | (map[2] << 16) | ((uint32_t)map[3] << 24);
+
+    if (used > s->len / ds->page_size) {                                // More data pages than the slot holds
+        printf("\nBad page map from the device!\n");
+        return -1;
+    }
+    for (uint32_t i = 0, n; i < s->pages; i += n) {
+        int data = (map[4 + i / 8] >> (i % 8)) & 1;
+        for (n = 1; i + n < s->pages && ((map[4 + (i+n) / 8] >> ((i+n) % 8)) & 1) == data; n++) {
+        }
+        if (data) {
+            if (n > used) {                                             // Map and count disagree, the dump would come up short
+                printf("\nBad page map from the device!\n");
+                return -1;
+            }
+            if (!ds->sink(ds->arg, p, (size_t)n * ds->page_size)) {
+                return -1;
+            }
+            p += (size_t)n * ds->page_size;
+            used -= n;
+        } else if (!ds->sink(ds->arg, NULL, (size_t)n * ds->page_size)) {
+            return -1;
         }
-        fel_chip_spi_run(ctx, cbuf, sizeof (cbuf));              // Run Command buffer
-        progress_update(&p, ERASE_CMD_SZ*n*pdat.info.pages_per_block);
     }
-    progress_stop(&p);
+    if (used != 0) {
+        printf("\nBad page map from the device!\n");
+        return -1;
+    }
     return 1;
 }
 
-int dso2d_dump(struct xfel_ctx_t *ctx, void *buf)
+int dso2d_dump(struct xfel_ctx_t *ctx, dso2d_sink_t sink, void *arg)
 {
-    enum {
-        RX_CMD_SZ     = 28U,
-        RX_BLOCK_SIZE = 128U,
-    };
+    enum { RX_BLOCK_SIZE = 128U };
 
     struct spinand_pdata_t pdat;
 
@@ -403,175 +797,561 @@ int dso2d_dump(struct xfel_ctx_t *ctx, void *buf)
         return 0;
     }
 
-    struct progress_t progress;
-    uint32_t page = 0, pages = pdat.info.pages_per_block*pdat.info.blocks_per_die*pdat.info.ndies*pdat.info.planes_per_die;
+    struct op_progress_t progress;
+    uint32_t page = 0, pages = spinand_pages(&pdat.info);
     uint32_t page_size = pdat.info.page_size;
     uint32_t read_size = RX_BLOCK_SIZE * page_size;
-    uint8_t cbuf[(RX_CMD_SZ*RX_BLOCK_SIZE) + 1];
-
-    for (size_t i = 0; i < RX_BLOCK_SIZE; i++) { // Make a large cmd queue to reduce overhead
-        uint8_t *d = &cbuf[RX_CMD_SZ*i];
-
-        d[0] = SPI_CMD_SELECT;
-        d[1] = SPI_CMD_FAST;
-        d[2] = 4;
-        d[3] = OPCODE_READ_PAGE_TO_CACHE;                               // Load page into buffer
-        d[4] = 0;                                                       // Dummy
-                                                                        // 5-6 Page address to read, updated later
-        d[7] = SPI_CMD_DESELECT;
-        d[8] = SPI_CMD_SELECT;
-        d[9] = SPI_CMD_SPINAND_WAIT;                                    // Check Busy flag
-        d[10] = SPI_CMD_DESELECT;
-        d[11] = SPI_CMD_SELECT;
-        d[12] = SPI_CMD_FAST;
-        d[13] = 4;
-        d[14] = OPCODE_READ_PAGE_FROM_CACHE;                            // Read data from buffer
-        d[15] = 0;                                                      // Column address H
-        d[16] = 0;                                                      // Column address L
-        d[17] = 0;                                                      // Dummy
-        d[18] = SPI_CMD_RXBUF;                                          // Receive data into RX Buffer
-                                                                        // 19-22 Dest address,  updated later
-        d[23] = (page_size>>0)  & 0xFF;                                 // Rx length = page size + spare size
-        d[24] = (page_size>>8)  & 0xFF;
-        d[25] = (page_size>>16) & 0xFF;
-        d[26] = (page_size>>24) & 0xFF;
-        d[27] = SPI_CMD_DESELECT;
-    }
-
-    cbuf[RX_CMD_SZ*RX_BLOCK_SIZE] = SPI_CMD_END;
+    uint32_t map_addr = pdat.swapbuf + read_size;
+    uint8_t cbuf[(READ_CMD_SZ*RX_BLOCK_SIZE) + (2*DIE_CMD_SZ) + PACK_CMD_SZ + 1];    // A batch crosses a die boundary once at most
+    enum { MAP_SZ = 4 + RX_BLOCK_SIZE/8 };                              // Data page count, bitmap
 
     if (sizeof (cbuf) > pdat.cmdlen ) {
         printf("cbuf: is too large for cmdbuf! %zu : %u\n", sizeof (cbuf), pdat.cmdlen);
         return 0;
     }
 
-    printf("Reading flash...\n");
-    progress_start(&progress, pages*page_size);
+    // The SoC can't serve USB while the payload runs, so SPI and USB stay serial;
+    // what overlaps is the sink (file, hash) draining batch N on its own thread
+    // while batch N+1 is being read. Erased pages are dropped by the payload and
+    // only the data pages cross USB.
+    struct dump_sink_t ds = { sink, arg, page_size };
+    struct pipeline pipe;
+    if (!pipeline_start(&pipe, read_size + MAP_SZ, 0, dump_drain, &ds)) {
+        printf("Unable to allocate read buffers!\n");
+        return 0;
+    }
+
+    int ret = 1;
+    op_progress_start(&progress, "Reading flash", pages*page_size);
 
     while (page < pages) {
-        for (size_t i = 0; i < RX_BLOCK_SIZE; ++i) {
-            uint8_t *d = &cbuf[RX_CMD_SZ*i];
-            uint32_t p = page+i;
-            uint32_t dst_addr = pdat.swapbuf+(i*page_size);
-
-            d[5] = (p>>8)  & 0xFF;                                      // Page address to read H
-            d[6] = (p>>0)  & 0xFF;                                      // Page address to read L
-            d[19] = (dst_addr>>0)  & 0xFF;                              // Dest address
-            d[20] = (dst_addr>>8)  & 0xFF;
-            d[21] = (dst_addr>>16) & 0xFF;
-            d[22] = (dst_addr>>24) & 0xFF;
-        }
-        fel_chip_spi_run(ctx, cbuf, sizeof (cbuf));                      // Run Command buffer
-        fel_read(ctx, pdat.swapbuf, buf, read_size);                    // Receive RX buffer
-        buf += read_size;
+        struct pipeline_slot *slot = pipeline_next(&pipe);
+        if (!slot) {
+            ret = 0;
+            break;
+        }
+
+        uint32_t clen = cmd_pages_read(cbuf, &pdat, page, RX_BLOCK_SIZE, pdat.swapbuf);   // Make a large cmd queue to reduce overhead
+        cmd_pack(&cbuf[clen], pdat.swapbuf, page_size, RX_BLOCK_SIZE, map_addr);
+        clen += PACK_CMD_SZ;
+        cbuf[clen++] = SPI_CMD_END;
+        uint8_t *map = &slot->buf[read_size];
+        if (!fel_chip_spi_run(ctx, cbuf, clen)                          // Run Command buffer
+         || !usb_fel_read(ctx, map_addr, map, MAP_SZ)) {                // Which pages hold data
+            ret = 0;
+            break;
+        }
+        uint32_t used = map[0] | (map[1] << 8) | (map[2] << 16) | ((uint32_t)map[3] << 24);
+        if (used > RX_BLOCK_SIZE
+         || (used && !usb_fel_read(ctx, pdat.swapbuf, slot->buf, used*page_size))) {    // Receive only those
+            ret = 0;
+            break;
+        }
+        slot->len = read_size;
+        slot->page = page;
+        slot->pages = RX_BLOCK_SIZE;
+        pipeline_done(&pipe, slot);                                     // Hand batch over to the sink
         page += RX_BLOCK_SIZE;
-        progress_update(&progress, read_size);
+        op_progress_update(&progress, read_size);
     }
-    progress_stop(&progress);
-    return 1;
+    if (!pipeline_stop(&pipe)) {
+        ret = 0;
+    }
+    op_progress_stop(&progress);
+    return ret;
 }
 
-int dso2d_restore(struct xfel_ctx_t *ctx, void *buf)
+static int block_crc(struct xfel_ctx_t *ctx, const struct spinand_pdata_t *pdat, uint32_t *crc, uint32_t blocks, const uint8_t *sel)
 {
+    enum { CRC_BATCH = 64U };                                           // Blocks per payload run
+
+    uint32_t page_size = pdat->info.page_size, ppb = pdat->info.pages_per_block;
+    uint32_t block_size = page_size * ppb;
+    uint32_t digests = pdat->swapbuf + block_size;                      // CRC table right after the block being checked
+    size_t block_cmd = (size_t)READ_CMD_SZ*ppb + DIE_CMD_SZ + CRC_CMD_SZ;
+    uint8_t raw[4*CRC_BATCH];
+    uint32_t index[CRC_BATCH];
+
+    if (block_cmd*CRC_BATCH + 1 > pdat->cmdlen || block_size + sizeof (raw) > pdat->swaplen) {
+        printf("CRC batch doesn't fit in SDRAM!\n");
+        return 0;
+    }
+    uint8_t *cbuf = malloc(block_cmd*CRC_BATCH + 1);
+    if (!cbuf) {
+        printf("Unable to allocate cmd buffer!\n");
+        return 0;
+    }
+
+    struct op_progress_t progress;
     int ret = 1;
 
+    memset(crc, 0, blocks * sizeof (*crc));
+    op_progress_start(&progress, "Computing block CRCs", (uint64_t)blocks*block_size);
+
+    // Every block is read into the same SDRAM area and reduced to a CRC word by
+    // the payload before the next one overwrites it; only the words are read back
+    for (uint32_t block = 0; block < blocks && ret;) {
+        uint32_t n = 0, first = block;
+        uint8_t *c = cbuf;
+        for (; n < CRC_BATCH && block < blocks; block++) {
+            if (!block_selected(sel, block)) {
+                continue;
+            }
+            c += cmd_pages_read(c, pdat, block*ppb, ppb, pdat->swapbuf);
+            cmd_crc32(c, pdat->swapbuf, block_size, digests + 4*n);
+            c += CRC_CMD_SZ;
+            index[n++] = block;
+        }
+        if (n) {
+            *c++ = SPI_CMD_END;
+            if (!fel_chip_spi_run(ctx, cbuf, c - cbuf)
+             || !usb_fel_read(ctx, digests, raw, 4*n)) {
+                ret = 0;
+                break;
+            }
+            for (uint32_t i = 0; i < n; i++) {
+                const uint8_t *r = &raw[4*i];
+                crc[index[i]] = r[0] | (r[1] << 8) | (r[2] << 16) | ((uint32_t)r[3] << 24);
+            }
+        }
+        op_progress_update(&progress, (uint64_t)(block - first)*block_size);
+    }
+    op_progress_stop(&progress);
+    free(cbuf);
+    return ret;
+}
+
+int dso2d_block_crc(struct xfel_ctx_t *ctx, uint32_t *crc, uint32_t blocks, const uint8_t *sel)
+{
+    struct spinand_pdata_t pdat;
+
+    if (!spinand_helper_init(ctx, &pdat, 0)) {
+        return 0;
+    }
+    return block_crc(ctx, &pdat, crc, blocks, sel);
+}
+
+static double seconds_since(const struct timespec *t0)
+{
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+// Same reads as the block CRCs of verify, so only the flash to SDRAM path is
+// timed and not the USB link; the CRCs of both passes have to agree
+static uint32_t mib_blocks(const struct spinand_info_t *info, uint32_t mib)
+{
+    uint32_t block_size = info->pages_per_block * info->page_size;
+    uint32_t blocks = (uint32_t)(((uint64_t)mib*1024*1024 + block_size - 1) / block_size);
+    if (blocks == 0 || blocks > info->blocks_per_die * info->ndies) {
+        blocks = info->blocks_per_die * info->ndies;
+    }
+    return blocks;
+}
+
+// Dual reads are used for the following steps of the run if both read the same
+int dso2d_bench(struct xfel_ctx_t *ctx, uint32_t mib)
+{
+    struct session_t *s = session_get(ctx);
+    struct spinand_pdata_t pdat;
+    uint32_t *crc[2];
+    double secs[2];
+    int ret = 1;
+
+    if (!spinand_helper_init(ctx, &pdat, 0)) {
+        return 0;
+    }
+    uint32_t block_size = pdat.info.pages_per_block * pdat.info.page_size;
+    uint32_t blocks = mib_blocks(&pdat.info, mib);
+    crc[0] = malloc(blocks * sizeof (uint32_t));
+    crc[1] = malloc(blocks * sizeof (uint32_t));
+    for (int dual = 0; dual < 2 && ret; dual++) {
+        struct timespec t0;
+        pdat.dual = dual;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        ret = crc[0] && crc[1] && block_crc(ctx, &pdat, crc[dual], blocks, NULL);
+        secs[dual] = seconds_since(&t0);
+    }
+    if (ret) {
+        double size = (double)blocks * block_size / (1024.0*1024);
+        printf("\nRead %.1f MiB:\n", size);
+        printf("  single (0x%02x): %6.2f s, %6.2f MiB/s\n", OPCODE_READ_PAGE_FROM_CACHE, secs[0], size / secs[0]);
+        printf("  dual   (0x%02x): %6.2f s, %6.2f MiB/s\n", OPCODE_READ_CACHE_X2, secs[1], size / secs[1]);
+        if (memcmp(crc[0], crc[1], blocks * sizeof (uint32_t)) != 0) {
+            printf("Single and dual reads differ!\n");
+            ret = 0;
+        } else if (s) {
+            s->spi_dual = 1;
+            printf("Dual reads match, used for the rest of this run; DSOFLASH_SPI_DUAL=1 keeps them for later ones\n");
+        }
+    }
+    free(crc[0]);
+    free(crc[1]);
+    return ret;
+}
+
+// 1 if the blocks read at AHB / (2 * (cdr2 + 1)) match ref, 0 if not, -1 if the reads failed
+static int calibrate_read(struct xfel_ctx_t *ctx, struct spinand_pdata_t *pdat, uint32_t ahb, uint32_t cdr2,
+                          const uint32_t *ref, uint32_t *crc, uint32_t blocks)
+{
+    fel_write32(ctx, SPI0_CCR, SPI_CCR_DRS | cdr2);
+    if (!block_crc(ctx, pdat, crc, blocks, NULL)) {
+        return -1;
+    }
+    int match = memcmp(ref, crc, blocks * sizeof (uint32_t)) == 0;
+    printf("%.2f MHz: %s\n", f1c100s_spi_hz(ahb, cdr2) / 1e6, match ? "match" : "MISMATCH");
+    return match;
+}
+
+// Steps the divider up from AHB / 8, comparing the CRCs of the same blocks with
+// those read at AHB / 8, until they stop matching; then backs off until the
+// fastest clock left matches CAL_REPEAT more times in a row. Settles on AHB / 8
+// if nothing faster holds, fails only if reads at AHB / 8 don't repeat.
+int dso2d_calibrate(struct xfel_ctx_t *ctx, uint32_t mib)
+{
     enum {
-        TX_CMD_SZ     = 32U,
-        TX_BLOCK_SIZE = 128U,
+        CAL_SLOWEST = 3U,                                               // CDR2 of the reference
+        CAL_REPEAT  = 2U,
     };
 
-    if (!dso2d_erase(ctx)) {
+    struct session_t *s = session_get(ctx);
+    struct spinand_pdata_t pdat;
+
+    if (!spinand_helper_init(ctx, &pdat, 0)) {
         return 0;
     }
+    uint32_t ahb = f1c100s_ahb_hz(ctx), blocks = mib_blocks(&pdat.info, mib), n = CAL_SLOWEST;
+    uint32_t *ref = malloc(blocks * sizeof (uint32_t)), *crc = malloc(blocks * sizeof (uint32_t));
+    int match = -1, repeats;
+
+    printf("\nAHB at %.2f MHz, reading %.1f MiB at each SPI clock\n", ahb / 1e6,
+           (double)blocks * pdat.info.pages_per_block * pdat.info.page_size / (1024.0*1024));
+    fel_write32(ctx, SPI0_CCR, SPI_CCR_DRS | CAL_SLOWEST);
+    if (ref && crc && block_crc(ctx, &pdat, ref, blocks, NULL)) {       // Reference, read twice
+        match = calibrate_read(ctx, &pdat, ahb, CAL_SLOWEST, ref, crc, blocks);
+        if (match == 0) {
+            printf("Reads don't repeat even at the slowest clock!\n");
+        }
+    }
+    repeats = (match == 1);
+    while (match == 1 && n > 0) {                                       // Step up
+        match = calibrate_read(ctx, &pdat, ahb, n - 1, ref, crc, blocks);
+        n -= (match == 1);
+    }
+    if (match == 0 && repeats) {
+        match = 1;                                                      // Clock n matched, the next faster one didn't
+    }
+    for (uint32_t i = 0; match == 1 && i < CAL_REPEAT && n < CAL_SLOWEST;) {
+        match = calibrate_read(ctx, &pdat, ahb, n, ref, crc, blocks);
+        if (match == 1) {
+            i++;
+        } else if (match == 0) {                                        // Back off and start over
+            n++;
+            i = 0;
+            match = 1;
+        }
+    }
+
+    if (match == 1) {
+        uint32_t hz = f1c100s_spi_hz(ahb, SPI_CCR_DRS | n);
+        if (s) {
+            s->spi_ccr = SPI_CCR_DRS | n;
+        }
+        fel_write32(ctx, SPI0_CCR, SPI_CCR_DRS | n);
+        printf("\nSPI clock set to %.2f MHz for this run, DSOFLASH_SPI_CLOCK=%g keeps it for later ones\n", hz / 1e6, hz / 1e6);
+    } else {
+        uint32_t ccr = (s && s->spi_ccr) ? s->spi_ccr : SPI_CCR_DEFAULT;
+        if (f1c100s_spi_hz(ahb, ccr) > f1c100s_spi_hz(ahb, SPI_CCR_DRS | CAL_SLOWEST)) {
+            ccr = SPI_CCR_DRS | CAL_SLOWEST;                            // Nothing faster than the clock that didn't hold
+            if (s) {
+                s->spi_ccr = ccr;
+            }
+        }
+        fel_write32(ctx, SPI0_CCR, ccr);
+    }
+    free(ref);
+    free(crc);
+    return match == 1;
+}
+
+enum {
+    TX_CMD_SZ     = 32U,
+    TX_BLOCK_SIZE = 128U,
+    TX_STAGES     = PIPELINE_SLOTS,
+    TX_MAX_SEGS   = 4U,                                                 // Uploads straight from the image per batch
+    TX_ERASES     = 64U,                                                // Block erases per batch
+};
+
+struct restore_batch_t {
+    uint8_t cbuf[((DIE_CMD_SZ + TX_CMD_SZ)*TX_BLOCK_SIZE) + ((DIE_CMD_SZ + WAIT_CMD_SZ + ERASE_CMD_SZ)*TX_ERASES)
+               + (SPINAND_DIES_MAX*(DIE_CMD_SZ + WAIT_CMD_SZ)) + 1];
+    uint32_t clen;
+    uint32_t nseg;
+    struct {
+        const uint8_t *p;                                               // Either into the image or the slot buffer
+        uint32_t len;
+    } seg[TX_BLOCK_SIZE];                                               // Data to upload, back to back in the staging area
+};
+
+struct restore_stage_t {
+    struct image_t *img;
+    const uint8_t *blocks;                                              // Blocks to rewrite, NULL for all
+    int erased;                                                         // Blocks already erased, program only
+    int cache_program;                                                  // Load each page while the one before programs
+    uint32_t page, pages;                                               // In die_turn() order
+    uint32_t page_size;
+    uint32_t pages_per_block;
+    const struct spinand_info_t *info;
+    uint32_t swapbuf;                                                   // First SDRAM staging area
+    uint32_t stage;
+    struct restore_batch_t batch[TX_STAGES];
+};
+
+// Same commands as the plain page program, but the busy wait comes after the
+// program load: the page shifts into the cache while the array still programs
+// the previous one, and is only committed once that one is done. The batch
+// ends with a wait of its own.
+static void cmd_cache_program(uint8_t *c, uint32_t src, uint32_t len, uint32_t row, uint32_t col)
+{
+    c[0]  = SPI_CMD_SELECT;
+    c[1]  = SPI_CMD_FAST;
+    c[2]  = 3;
+    c[3]  = OPCODE_PROGRAM_LOAD;                                            // Program load cmd (Write to flash buffer)
+    c[4]  = (col>>8) & 0xFF;                                                // Column address H, with the plane
+    c[5]  = (col>>0) & 0xFF;                                                // Column address L
+    c[6]  = SPI_CMD_TXBUF;                                                  // Transfer contents from TX Buffer
+    c[7]  = (src>>0)  & 0xFF;                                               // Src address = SDRAM staging area
+    c[8]  = (src>>8)  & 0xFF;
+    c[9]  = (src>>16) & 0xFF;
+    c[10] = (src>>24) & 0xFF;
+    c[11] = (len>>0)  & 0xFF;                                               // Tx length
+    c[12] = (len>>8)  & 0xFF;
+    c[13] = (len>>16) & 0xFF;
+    c[14] = (len>>24) & 0xFF;
+    c[15] = SPI_CMD_DESELECT;
+    c[16] = SPI_CMD_SELECT;
+    c[17] = SPI_CMD_SPINAND_WAIT;                                           // Previous page programmed
+    c[18] = SPI_CMD_DESELECT;
+    c[19] = SPI_CMD_SELECT;
+    c[20] = SPI_CMD_FAST;
+    c[21] = 1;
+    c[22] = OPCODE_WRITE_ENABLE;                                            // Write enable cmd
+    c[23] = SPI_CMD_DESELECT;
+    c[24] = SPI_CMD_SELECT;
+    c[25] = SPI_CMD_FAST;
+    c[26] = 4;
+    c[27] = OPCODE_PROGRAM_EXEC;                                            // Execute program (Write page)
+    c[28] = (row>>16) & 0xFF;                                               // Row address of the page to write
+    c[29] = (row>>8)  & 0xFF;
+    c[30] = (row>>0)  & 0xFF;
+    c[31] = SPI_CMD_DESELECT;
+}
+
+// Take the next TX_BLOCK_SIZE non-empty pages of the image and build the matching
+// command list for the next SDRAM staging area, erasing each block right before
+// its first page is programmed. Contiguous runs of pages are uploaded straight
+// from the image, anything more scattered is packed into the slot first.
+static int restore_stage(void *arg, struct pipeline_slot *s)
+{
+    struct restore_stage_t *st = arg;
+    struct restore_batch_t *b = &st->batch[st->stage % TX_STAGES];
+    const struct spinand_info_t *info = st->info;
+    uint32_t page_size = st->page_size, ppb = st->pages_per_block;
+    uint32_t stage_addr = st->swapbuf + (st->stage % TX_STAGES)*(TX_BLOCK_SIZE*page_size);
+    uint32_t i = 0, erases = 0;
+    int multi = (info->ndies > 1), wait_first = st->cache_program || multi;
+    int die = -1;
+    uint8_t *c = b->cbuf;
+
+    if (st->page >= st->pages) {
+        return 0;
+    }
+
+    s->page = st->page;
+    b->nseg = 0;
+    for (; (i < TX_BLOCK_SIZE) && (st->page < st->pages); st->page++) {
+        uint32_t page = multi ? die_turn(info, st->page, ppb * info->blocks_per_die) : st->page;
+        uint32_t row = page_row(info, page), col = page_column(info, page);
+
+        if (page % ppb == 0 && !st->erased && block_selected(st->blocks, page / ppb)) {
+            if (erases == TX_ERASES) {
+                break;
+            }
+            c = cmd_die_select(c, info, page_die(info, page), &die);
+            if (wait_first) {                                               // Last program on the die still running
+                c = cmd_wait(c);
+            }
+            cmd_block_erase(c, row);                                        // Erase block, programs of its pages follow
+            c += (multi && !st->cache_program) ? ERASE_CMD_SZ - WAIT_CMD_SZ : ERASE_CMD_SZ;
+            erases++;
+        }
+        if (!image_page_used(st->img, page)                                 // Empty pages (All FF) are skipped
+         || !block_selected(st->blocks, page / ppb)) {                      // and so are blocks left alone
+            continue;
+        }
+        const uint8_t *d = image_page(st->img, page_size, page);
+
+        if (b->nseg && b->seg[b->nseg - 1].p + b->seg[b->nseg - 1].len == d) {
+            b->seg[b->nseg - 1].len += page_size;                          // Contiguous with the previous page
+        } else {
+            b->seg[b->nseg].p = d;
+            b->seg[b->nseg].len = page_size;
+            b->nseg++;
+        }
+
+        uint32_t src = stage_addr + (i*page_size);
+
+        c = cmd_die_select(c, info, page_die(info, page), &die);
+        if (st->cache_program) {
+            cmd_cache_program(c, src, page_size, row, col);
+            c += TX_CMD_SZ;
+            i++;
+            continue;
+        }
+        if (multi) {                                                        // Wait for this die's previous program only,
+            c = cmd_wait(c);                                                // the other die keeps programming meanwhile
+        }
+        c[0]  = SPI_CMD_SELECT;                                             // Fill cmd data
+        c[1]  = SPI_CMD_FAST;
+        c[2]  = 1;
+        c[3]  = OPCODE_WRITE_ENABLE;                                        // Write enable cmd
+        c[4]  = SPI_CMD_DESELECT;
+        c[5]  = SPI_CMD_SELECT;
+        c[6]  = SPI_CMD_FAST;
+        c[7]  = 3;
+        c[8]  = OPCODE_PROGRAM_LOAD;                                        // Program load cmd (Write to flash buffer)
+        c[9]  = (col>>8) & 0xFF;                                            // Column address H, with the plane
+        c[10] = (col>>0) & 0xFF;                                            // Column address L
+        c[11] = SPI_CMD_TXBUF;                                              // Transfer contents from TX Buffer
+        c[12] = (src>>0)  & 0xFF;                                           // Src address = SDRAM staging area
+        c[13] = (src>>8)  & 0xFF;
+        c[14] = (src>>16) & 0xFF;
+        c[15] = (src>>24) & 0xFF;
+        c[16] = (page_size>>0)  & 0xFF;                                     // Tx length = page size + spare size
+        c[17] = (page_size>>8)  & 0xFF;
+        c[18] = (page_size>>16) & 0xFF;
+        c[19] = (page_size>>24) & 0xFF;
+        c[20] = SPI_CMD_DESELECT;
+        c[21] = SPI_CMD_SELECT;
+        c[22] = SPI_CMD_FAST;
+        c[23] = 4;
+        c[24] = OPCODE_PROGRAM_EXEC;                                        // Execute program (Write page)
+        c[25] = (row>>16) & 0xFF;                                           // Row address of the page to write
+        c[26] = (row>>8)  & 0xFF;
+        c[27] = (row>>0)  & 0xFF;
+        c[28] = SPI_CMD_DESELECT;
+        c[29] = SPI_CMD_SELECT;
+        c[30] = SPI_CMD_SPINAND_WAIT;                                       // Check busy
+        c[31] = SPI_CMD_DESELECT;
+        c += multi ? TX_CMD_SZ - WAIT_CMD_SZ : TX_CMD_SZ;
+        i++;
+    }
+    if (wait_first && (i > 0 || erases > 0)) {
+        c = multi ? cmd_wait_dies(c, info, &die) : cmd_wait(c);
+    }
+    *c++ = SPI_CMD_END;                                                     // Finish cmd
+    b->clen = c - b->cbuf;
+
+    if (b->nseg > TX_MAX_SEGS) {                                            // Scattered pages (or spare areas in between):
+        uint8_t *p = s->buf;                                                // one packed upload beats many small FEL requests
+        for (uint32_t k = 0; k < b->nseg; k++) {
+            memcpy(p, b->seg[k].p, b->seg[k].len);
+            p += b->seg[k].len;
+        }
+        b->seg[0].p = s->buf;
+        b->seg[0].len = i*page_size;
+        b->nseg = 1;
+    }
+
+    s->len = i*page_size;
+    s->pages = st->page - s->page;
+    s->priv = b;
+    st->stage++;
+    return 1;
+}
+
+int dso2d_restore(struct xfel_ctx_t *ctx, struct image_t *img, const uint8_t *blocks, int erased)
+{
+    int ret = 1;
 
     struct spinand_pdata_t pdat;
     if (!spinand_helper_init(ctx, &pdat, 1)) {
         return 0;
     }
 
-    struct progress_t progress;
-    uint32_t page = 0, pages = pdat.info.pages_per_block*pdat.info.blocks_per_die*pdat.info.ndies*pdat.info.planes_per_die;
+    struct op_progress_t progress;
+    uint32_t pages = spinand_pages(&pdat.info);
     uint32_t page_size = pdat.info.page_size;
-    uint32_t pages_to_write = 0;
-    uint8_t cbuf[(TX_CMD_SZ*TX_BLOCK_SIZE) + 1];                           // Make a large cmd queue to reduce overhead
-    uint8_t *dbuf = malloc(TX_BLOCK_SIZE*page_size);
+    uint32_t stage_size = TX_BLOCK_SIZE*page_size;
 
-    if ((sizeof cbuf) > pdat.cmdlen) {
-        printf("cbuf is too large for cmdbuf! %zu : %u\n", sizeof (cbuf), pdat.cmdlen);
-        ret = 0;
-        goto CLEANUP;
+    if (sizeof (((struct restore_batch_t *)0)->cbuf) > pdat.cmdlen || TX_STAGES*stage_size > pdat.swaplen) {
+        printf("Staging buffers don't fit in SDRAM!\n");
+        return 0;
     }
 
-    printf("\nWriting flash...\n");
-    progress_start(&progress, pages*page_size);
-    uint32_t last_page = 0, i;
-    uint8_t *d = buf;
-    while (page < pages) {
-        i = 0;
-        pages_to_write = 0;
-
-        for (uint32_t j = 0; (j < page_size) && (page < pages); ) {                // Scan data for empty pages (All FF), fill data buffer
-            if (d[j] != 0xFF) {                                              // If not FF data found, store page
-                memcpy(&dbuf[i*page_size], d, page_size);                   // Copy page data
-                uint8_t *c = &cbuf[i*TX_CMD_SZ];
-
-                c[0]  = SPI_CMD_SELECT;                                     // Fill cmd data
-                c[1]  = SPI_CMD_FAST;
-                c[2]  = 1;
-                c[3]  = OPCODE_WRITE_ENABLE;                                // Write enable cmd
-                c[4]  = SPI_CMD_DESELECT;
-                c[5]  = SPI_CMD_SELECT;
-                c[6]  = SPI_CMD_FAST;
-                c[7]  = 3;
-                c[8]  = OPCODE_PROGRAM_LOAD;                                // Program load cmd (Write to flash buffer)
-                c[9]  = 0;                                                  // Column address H
-                c[10] = 0;                                                  // Column address L
-                c[11] = SPI_CMD_TXBUF;                                      // Transfer contents from TX Buffer
-                c[12] = ((pdat.swapbuf+(i*page_size))>>0)  & 0xFF;          // Src address = SDRAM
-                c[13] = ((pdat.swapbuf+(i*page_size))>>8)  & 0xFF;
-                c[14] = ((pdat.swapbuf+(i*page_size))>>16) & 0xFF;
-                c[15] = ((pdat.swapbuf+(i*page_size))>>24) & 0xFF;
-                c[16] = (page_size>>0)  & 0xFF;                             // Tx length = page size + spare size
-                c[17] = (page_size>>8)  & 0xFF;
-                c[18] = (page_size>>16) & 0xFF;
-                c[19] = (page_size>>24) & 0xFF;
-                c[20] = SPI_CMD_DESELECT;
-                c[21] = SPI_CMD_SELECT;
-                c[22] = SPI_CMD_FAST;
-                c[23] = 4;
-                c[24] = OPCODE_PROGRAM_EXEC;                                // Execute program (Write page)
-                c[25] = 0;                                                  // Dummy
-                c[26] = (page>>8) & 0xFF;                                   // Page address to write H
-                c[27] = (page>>0) & 0xFF;                                   // Page address to write L                                                                      // 26-27 Page address to write, updated later
-                c[28] = SPI_CMD_DESELECT;
-                c[29] = SPI_CMD_SELECT;
-                c[30] = SPI_CMD_SPINAND_WAIT;                               // Check busy
-                c[31] = SPI_CMD_DESELECT;
-
-                pages_to_write++;                                           // Increase pages to be written
-                page++;                                                     // Increase current page
-                d += page_size;                                             // Increase input buffer
-                j = 0;
-                if (++i >= TX_BLOCK_SIZE) {
-                    break;
-                }                                                           // Done with this page
-            } else if (++j == page_size) {                                  // Increase scan, if reached end of page, it's empty, skip
-                page++;                                                     // Increase page
-                d += page_size;                                             // Increase input buffer
-                j = 0;                                                        // Reset counter
-            }
-        }
-        cbuf[pages_to_write*TX_CMD_SZ] = SPI_CMD_END;                       // Finish cmd
-        fel_write(ctx, pdat.swapbuf, dbuf, pages_to_write * page_size);     // Transfer TX buffer
-        fel_chip_spi_run(ctx, cbuf, (TX_CMD_SZ*pages_to_write)+1);          // Run Command buffer
-        progress_update(&progress, (page-last_page)*page_size);                    // Update progress
-        last_page = page;
+    if (img->pages < pages && !image_scan(img, page_size, pages)) {         // Unless the caller already did
+        printf("Unable to allocate page bitmap!\n");
+        return 0;
     }
 
-    progress_stop(&progress);
+    // Assembling and packing of the next batch runs on a worker thread while the
+    // current one is uploaded and programmed. Batches alternate between
+    // TX_STAGES staging areas, so a new upload never lands on data the
+    // previous command list refers to.
+    struct restore_stage_t *st = malloc(sizeof (*st));
+    struct pipeline pipe;
+    if (!st) {
+        printf("Unable to allocate write buffers!\n");
+        return 0;
+    }
+    st->img = img;
+    st->blocks = blocks;
+    st->erased = erased;
+    st->cache_program = (pdat.info.flags & SPINAND_CACHE_PROGRAM) || getenv("DSOFLASH_CACHE_PROGRAM");
+    st->pages_per_block = pdat.info.pages_per_block;
+    st->info = &pdat.info;
+    st->page = 0;
+    st->pages = pages;
+    st->page_size = page_size;
+    st->swapbuf = pdat.swapbuf;
+    st->stage = 0;
+    if (!pipeline_start(&pipe, stage_size, 1, restore_stage, st)) {
+        printf("Unable to allocate write buffers!\n");
+        free(st);
+        return 0;
+    }
 
-CLEANUP:
-    free(dbuf);
+    op_progress_start(&progress, "Writing flash", pages*page_size);
+    for (uint32_t stage = 0; ; stage++) {
+        struct pipeline_slot *slot = pipeline_next(&pipe);
+        if (!slot) {
+            break;
+        }
+        struct restore_batch_t *b = slot->priv;
+        if (b->clen > 1) {
+            uint32_t addr = pdat.swapbuf + (stage % TX_STAGES)*stage_size;
+            struct usb_queue q;
+            usb_queue_init(&q, ctx);
+            for (uint32_t i = 0; i < b->nseg; i++) {                        // Transfer TX data
+                usb_queue_write(&q, addr, b->seg[i].p, b->seg[i].len);
+                addr += b->seg[i].len;
+            }
+            int ok = usb_queue_flush(&q);
+            usb_queue_free(&q);
+            if (!ok || !fel_chip_spi_run(ctx, b->cbuf, b->clen)) {          // Run Command buffer
+                ret = 0;
+                break;
+            }
+        }
+        op_progress_update(&progress, slot->pages*page_size);               // Update progress
+        pipeline_done(&pipe, slot);
+    }
+    if (!pipeline_stop(&pipe)) {
+        ret = 0;
+    }
+    op_progress_stop(&progress);
+    free(st);
 
     return ret;
 }
@@ -579,7 +1359,7 @@ CLEANUP:
 int dso2d_dump_regs(struct xfel_ctx_t *ctx)
 {
     struct spinand_pdata_t pdat;
-    if (!spinand_helper_init(ctx, &pdat, 0)) {
+    if (!spinand_helper_init(ctx, &pdat, 0) || !spinand_die_select(ctx, &pdat, 0)) {
         return 0;
     }
 
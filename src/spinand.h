@@ -9,11 +9,85 @@
 
 #include <fel.h>
 
+#include "image.h"
+
+struct spinand_info_t {
+    const char *name;
+    struct {
+        uint8_t val[4];
+        uint8_t len;
+    } id;
+    uint32_t page_size;
+    uint32_t spare_size;
+    uint32_t pages_per_block;
+    uint32_t blocks_per_die;                // All planes of a die, the die's row addresses go up to pages_per_block * blocks_per_die
+    uint32_t planes_per_die;                // Blocks alternate between planes, a column address bit above the page picks the plane
+    uint32_t ndies;                         // Stacked dies, picked by OPCODE_DIE_SELECT or SPINAND_DIE_FEATURE
+    uint32_t flags;
+};
+
+enum {
+    SPINAND_CACHE_READ          = 0x01,     // Sequential cache read, 0x31/0x3f
+    SPINAND_CACHE_PROGRAM       = 0x02,     // Program load accepted while the previous page programs
+    SPINAND_DIE_FEATURE         = 0x04,     // Die picked by bit 6 of feature OPCODE_FEATURE_DIE (Micron), not by OPCODE_DIE_SELECT
+};
+
+#define SPINAND_DIES_MAX        4U
+
+enum {
+    OPCODE_RDID                 = 0x9f,
+    OPCODE_GET_FEATURE          = 0x0f,
+    OPCODE_SET_FEATURE          = 0x1f,
+    OPCODE_FEATURE_PROTECT      = 0xa0,
+    OPCODE_FEATURE_CONFIG       = 0xb0,
+    OPCODE_FEATURE_STATUS       = 0xc0,
+    OPCODE_FEATURE_DIE          = 0xd0,
+    OPCODE_DIE_SELECT           = 0xc2,
+    OPCODE_READ_PAGE_TO_CACHE   = 0x13,
+    OPCODE_READ_PAGE_FROM_CACHE = 0x03,
+    OPCODE_READ_CACHE_X2        = 0x3b,
+    OPCODE_READ_CACHE_SEQ       = 0x31,
+    OPCODE_READ_CACHE_END       = 0x3f,
+    OPCODE_WRITE_ENABLE         = 0x06,
+    OPCODE_BLOCK_ERASE          = 0xd8,
+    OPCODE_PROGRAM_LOAD         = 0x02,
+    OPCODE_PROGRAM_EXEC         = 0x10,
+    OPCODE_RESET                = 0xff,
+};
+
+const struct spinand_info_t * spinand_lookup(const char *name);
+
+static inline uint32_t spinand_pages(const struct spinand_info_t *info)
+{
+    return info->pages_per_block * info->blocks_per_die * info->ndies;
+}
+
 int spinand_detect(struct xfel_ctx_t *ctx, char *name, size_t *capacity);
 
-int dso2d_dump(struct xfel_ctx_t *ctx, void *buf);
-int dso2d_restore(struct xfel_ctx_t *ctx, void *buf);
-int dso2d_erase(struct xfel_ctx_t *ctx);
+// Receives the flash contents in order, batch by batch; data is NULL for len
+// bytes of erased (all 0xFF) flash. Returns 0 to abort.
+typedef int (*dso2d_sink_t)(void *arg, const void *data, size_t len);
+
+// Erase, dump, CRC and restore draw a progress bar on the console, unless the
+// calling thread set a callback to take the progress instead (NULL restores
+// the bar). Station mode runs one device per thread and reports them together.
+typedef void (*dso2d_progress_t)(void *arg, const char *what, uint64_t done, uint64_t total);
+void dso2d_set_progress(dso2d_progress_t cb, void *arg);
+
+int dso2d_dump(struct xfel_ctx_t *ctx, dso2d_sink_t sink, void *arg);
+// CRC-32 of the data area of the blocks in sel (NULL for all), computed on the SoC
+int dso2d_block_crc(struct xfel_ctx_t *ctx, uint32_t *crc, uint32_t blocks, const uint8_t *sel);
+
+// blocks: bitmap of blocks to erase and program, NULL for the whole flash;
+// erased: dso2d_erase() already ran on them, they are only programmed
+int dso2d_restore(struct xfel_ctx_t *ctx, struct image_t *img, const uint8_t *blocks, int erased);
+int dso2d_erase(struct xfel_ctx_t *ctx, const uint8_t *blocks);
 int dso2d_dump_regs(struct xfel_ctx_t *ctx);
+// Times reading the first mib MiB (0 for all) into SDRAM with single and dual
+// line reads, and checks that both read the same
+int dso2d_bench(struct xfel_ctx_t *ctx, uint32_t mib);
+// Finds the fastest SPI clock the first mib MiB read back right at and keeps
+// it for the session
+int dso2d_calibrate(struct xfel_ctx_t *ctx, uint32_t mib);
 
 #endif // SPINAND_H_
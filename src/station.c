@@ -0,0 +1,210 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "session.h"
+#include "spinand.h"
+#include "station.h"
+
+#define STATUS_PERIOD   500000              // us between status line refreshes
+
+// Usable devices are left open with their flash detected; the rest are marked failed
+int station_open(struct station_t *st)
+{
+    char paths[STATION_DEVICES_MAX][USB_PATH_MAX];
+    size_t pending = 0, usable = 0;
+    struct usb_backoff wait;
+
+    memset(st, 0, sizeof (*st));
+    pthread_mutex_init(&st->lock, NULL);
+    st->ndev = usb_fel_devices(paths, STATION_DEVICES_MAX);
+    if (!st->ndev) {
+        printf("ERROR: No FEL device found\n");
+        return 0;
+    }
+
+    printf("\nConfiguring USB to HS mode on %zu devices... ", st->ndev);
+    fflush(stdout);
+    for (size_t i = 0; i < st->ndev; i++) {
+        struct station_dev_t *d = &st->dev[i];
+        d->st = st;
+        strcpy(d->path, paths[i]);
+        d->ctx.hdl = usb_open_path(d->path);
+        if (!d->ctx.hdl || !fel_init(&d->ctx)) {
+            d->state = STATION_FAILED;
+        } else if (usb_high_speed(d->ctx.hdl)) {                    // Switched by an earlier run, keep it
+            continue;
+        } else {
+            fel_write32(&d->ctx, 0x01c13040, 0x29860);
+            pending++;
+        }
+        if (d->ctx.hdl) {
+            libusb_close(d->ctx.hdl);
+            d->ctx.hdl = NULL;
+        }
+    }
+
+    // All of them re-enumerate at the same time, the wait is paid once
+    usb_backoff_init(&wait);
+    while (pending && usb_backoff_wait(&wait)) {
+        for (size_t i = 0; i < st->ndev; i++) {
+            struct station_dev_t *d = &st->dev[i];
+            if (d->state == STATION_FAILED || d->ctx.hdl) {
+                continue;
+            }
+            d->ctx.hdl = usb_open_path(d->path);
+            if (d->ctx.hdl && !(usb_reenumerated(d->ctx.hdl, &wait) && fel_init(&d->ctx))) {
+                libusb_close(d->ctx.hdl);
+                d->ctx.hdl = NULL;
+            }
+            pending -= (d->ctx.hdl != NULL);
+        }
+    }
+    if (pending) {
+        printf("%zu didn't come back\n\n", pending);
+    } else {
+        printf("OK\n\n");
+    }
+
+    for (size_t i = 0; i < st->ndev; i++) {
+        struct station_dev_t *d = &st->dev[i];
+        if (d->state == STATION_FAILED) {
+            printf("%s: Unable to open FEL device!\n", d->path);
+        } else if (!d->ctx.hdl) {
+            printf("%s: FEL device lost after the HS switch!\n", d->path);
+            d->state = STATION_FAILED;
+        } else if (!spinand_detect(&d->ctx, d->name, &d->capacity)) {
+            printf("%s: Unknown flash memory!\n", d->path);
+            d->state = STATION_FAILED;
+        } else {
+            printf("%s: Flash found: '%s'  Size: %zu MB\n", d->path, d->name, d->capacity/((size_t)1024*1024));
+            d->usable = 1;
+            usable++;
+        }
+    }
+    return usable > 0;
+}
+
+static void station_progress(void *arg, const char *what, uint64_t done, uint64_t total)
+{
+    struct station_dev_t *d = arg;
+
+    pthread_mutex_lock(&d->st->lock);
+    d->what = what;
+    d->done = done;
+    d->total = total;
+    pthread_mutex_unlock(&d->st->lock);
+}
+
+static void * station_worker(void *arg)
+{
+    struct station_dev_t *d = arg;
+
+    dso2d_set_progress(station_progress, d);
+    int ok = d->st->job(d, d->st->arg);
+
+    pthread_mutex_lock(&d->st->lock);
+    d->state = ok ? STATION_OK : STATION_FAILED;
+    pthread_mutex_unlock(&d->st->lock);
+    return NULL;
+}
+
+// One line for all devices: port, first word of the operation, percentage
+static size_t station_status(struct station_t *st)
+{
+    FILE *out = st->report ? st->report : stdout;
+    size_t running = 0;
+
+    pthread_mutex_lock(&st->lock);
+    if (!st->report) {
+        printf("\r");
+    }
+    for (size_t i = 0; i < st->ndev; i++) {
+        const struct station_dev_t *d = &st->dev[i];
+        const char *what = d->what ? d->what : "Starting";
+        int len = (int)strcspn(what, " ");
+        unsigned pct = d->total ? 100*d->done/d->total : 0;
+        if (d->state == STATION_READY) {
+            continue;                                               // Not taking part
+        } else if (d->state != STATION_RUNNING) {
+            if (!st->report) {
+                printf("%s %-14s  ", d->path, (d->state == STATION_OK) ? "done" : "FAILED");
+            }
+            continue;
+        }
+        if (st->report) {
+            fprintf(out, "progress %s %.*s %u\n", d->path, len, what, pct);
+        } else {
+            printf("%s %-9.*s %3u%%  ", d->path, len, what, pct);
+        }
+        running++;
+    }
+    pthread_mutex_unlock(&st->lock);
+    fflush(out);
+    return running;
+}
+
+size_t station_run(struct station_t *st, int (*job)(struct station_dev_t *d, void *arg), void *arg)
+{
+    size_t failed = 0;
+
+    st->job = job;
+    st->arg = arg;
+    printf("\n");
+    for (size_t i = 0; i < st->ndev; i++) {
+        struct station_dev_t *d = &st->dev[i];
+        if (d->skip || !d->usable) {
+            d->state = d->skip ? STATION_READY : STATION_FAILED;    // Not taking part, or unable to
+            continue;
+        }
+        d->what = NULL;
+        d->done = d->total = 0;
+        d->state = STATION_RUNNING;
+        d->worker = (pthread_create(&d->thread, NULL, station_worker, d) == 0);
+        if (!d->worker) {
+            printf("%s: Unable to start worker thread!\n", d->path);
+            d->state = STATION_FAILED;
+        }
+    }
+
+    while (station_status(st)) {
+        usleep(STATUS_PERIOD);
+    }
+    printf("\n\n");
+
+    for (size_t i = 0; i < st->ndev; i++) {
+        struct station_dev_t *d = &st->dev[i];
+        if (d->worker) {
+            pthread_join(d->thread, NULL);
+            d->worker = 0;
+        }
+        if (d->state == STATION_READY) {
+            continue;
+        }
+        failed += (d->state != STATION_OK);
+        printf("%s: %s\n", d->path, (d->state == STATION_OK) ? "OK" : "FAILED");
+        if (st->report) {
+            fprintf(st->report, "result %s %s\n", d->path, (d->state == STATION_OK) ? "ok" : "failed");
+        }
+    }
+    if (st->report) {
+        fflush(st->report);
+    }
+    return failed;
+}
+
+void station_close(struct station_t *st)
+{
+    for (size_t i = 0; i < st->ndev; i++) {
+        if (st->dev[i].ctx.hdl) {
+            libusb_close(st->dev[i].ctx.hdl);
+        }
+        session_end(&st->dev[i].ctx);
+    }
+    pthread_mutex_destroy(&st->lock);
+    memset(st, 0, sizeof (*st));
+}
@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#ifndef STATION_H_
+#define STATION_H_
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include <fel.h>
+
+#include "usb.h"
+
+#define STATION_DEVICES_MAX 16
+
+enum {
+    STATION_READY,
+    STATION_RUNNING,
+    STATION_OK,
+    STATION_FAILED,
+};
+
+struct station_t;
+
+struct station_dev_t {
+    struct station_t *st;
+    struct xfel_ctx_t ctx;
+    char path[USB_PATH_MAX];
+    char name[128];             // Flash chip
+    size_t capacity;
+    int usable;                 // Open with its flash detected
+    int skip;                   // Left out of the next station_run()
+    pthread_t thread;
+    int worker;                 // thread is running or waiting to be joined
+
+    // Progress, written by the worker under st->lock
+    const char *what;
+    uint64_t done, total;
+    int state;
+};
+
+/*
+ * Station mode: every FEL device on the host, told apart by USB port, each
+ * driven by its own worker thread running the same job. Devices only share
+ * what the job hands them read-only (the source image), and their progress
+ * is collected into one status line.
+ *
+ * With report set, progress and results are written to it as lines instead:
+ *   progress <port> <operation> <percent>
+ *   result <port> ok|failed
+ */
+struct station_t {
+    struct station_dev_t dev[STATION_DEVICES_MAX];
+    size_t ndev;
+    FILE *report;
+    pthread_mutex_t lock;
+    int (*job)(struct station_dev_t *d, void *arg);
+    void *arg;
+};
+
+int station_open(struct station_t *st);
+// Runs job on every usable device that isn't skipped, returns how many failed
+size_t station_run(struct station_t *st, int (*job)(struct station_dev_t *d, void *arg), void *arg);
+void station_close(struct station_t *st);
+
+#endif // STATION_H_
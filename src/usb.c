@@ -0,0 +1,361 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "usb.h"
+
+#define USB_TIMEOUT     10000               // ms
+#define REENUM_TIMEOUT  10000               // ms to wait for a device to come back in HS mode
+#define REENUM_POLL     10                  // ms, first delay between polls, doubled up to
+#define REENUM_POLL_MAX 200
+#define REENUM_TRUST    1000                // ms after which a device of unknown speed is taken
+
+enum {
+    AW_USB_READ    = 0x11,
+    AW_USB_WRITE   = 0x12,
+
+    AW_FEL_1_WRITE = 0x101,
+    AW_FEL_1_EXEC  = 0x102,
+    AW_FEL_1_READ  = 0x103,
+};
+
+enum {
+    STEP_OUT,                               // Host to device
+    STEP_IN,                                // Device to host, payload
+    STEP_AWUS,                              // Device to host, AWUS response to check
+};
+
+struct usb_step {
+    uint8_t kind;
+    uint8_t *data;                          // NULL for steps carrying hdr
+    uint32_t len;
+    uint8_t hdr[32];
+    int done;
+    struct libusb_transfer *xfer;
+};
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = (v>>0)  & 0xFF;
+    p[1] = (v>>8)  & 0xFF;
+    p[2] = (v>>16) & 0xFF;
+    p[3] = (v>>24) & 0xFF;
+}
+
+static struct usb_step * add_step(struct usb_queue *q, uint8_t kind, void *data, uint32_t len)
+{
+    if (q->nsteps == q->cap) {
+        size_t cap = q->cap ? q->cap*2 : 64;
+        struct usb_step *s = realloc(q->steps, cap * sizeof (*s));
+        if (!s) {
+            q->failed = 1;
+            return NULL;
+        }
+        q->steps = s;
+        q->cap = cap;
+    }
+    struct usb_step *s = &q->steps[q->nsteps++];
+    memset(s, 0, sizeof (*s));
+    s->kind = kind;
+    s->data = data;
+    s->len = len;
+    return s;
+}
+
+// AWUC wrapper announcing the direction and length of the next transfer
+static void add_usb_request(struct usb_queue *q, uint16_t type, uint32_t len)
+{
+    struct usb_step *s = add_step(q, STEP_OUT, NULL, 32);
+    if (s) {
+        memcpy(s->hdr, "AWUC", 4);
+        put_le32(&s->hdr[8], len);
+        put_le32(&s->hdr[12], 0x0c000000);
+        s->hdr[16] = (type>>0) & 0xFF;
+        s->hdr[17] = (type>>8) & 0xFF;
+        put_le32(&s->hdr[18], len);
+    }
+}
+
+static void add_usb_write(struct usb_queue *q, const void *data, uint32_t len)
+{
+    add_usb_request(q, AW_USB_WRITE, len);
+    add_step(q, STEP_OUT, (void *)data, len);
+    add_step(q, STEP_AWUS, NULL, 13);
+}
+
+static void add_usb_read(struct usb_queue *q, void *data, uint32_t len)
+{
+    add_usb_request(q, AW_USB_READ, len);
+    add_step(q, STEP_IN, data, len);
+    add_step(q, STEP_AWUS, NULL, 13);
+}
+
+static void add_fel_request(struct usb_queue *q, uint32_t type, uint32_t addr, uint32_t len)
+{
+    add_usb_request(q, AW_USB_WRITE, 16);
+    struct usb_step *s = add_step(q, STEP_OUT, NULL, 16);
+    if (s) {
+        put_le32(&s->hdr[0], type);
+        put_le32(&s->hdr[4], addr);
+        put_le32(&s->hdr[8], len);
+    }
+    add_step(q, STEP_AWUS, NULL, 13);
+}
+
+static void add_fel_status(struct usb_queue *q)
+{
+    add_usb_request(q, AW_USB_READ, 8);
+    add_step(q, STEP_IN, NULL, 8);
+    add_step(q, STEP_AWUS, NULL, 13);
+}
+
+void usb_queue_init(struct usb_queue *q, struct xfel_ctx_t *ctx)
+{
+    memset(q, 0, sizeof (*q));
+    q->ctx = ctx;
+}
+
+void usb_queue_free(struct usb_queue *q)
+{
+    free(q->steps);
+    q->steps = NULL;
+    q->nsteps = q->cap = 0;
+}
+
+void usb_queue_write(struct usb_queue *q, uint32_t addr, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    while (len > 0) {
+        uint32_t n = (len > USB_FEL_CHUNK) ? USB_FEL_CHUNK : len;
+        add_fel_request(q, AW_FEL_1_WRITE, addr, n);
+        add_usb_write(q, p, n);
+        add_fel_status(q);
+        addr += n;
+        p += n;
+        len -= n;
+    }
+}
+
+void usb_queue_read(struct usb_queue *q, uint32_t addr, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    while (len > 0) {
+        uint32_t n = (len > USB_FEL_CHUNK) ? USB_FEL_CHUNK : len;
+        add_fel_request(q, AW_FEL_1_READ, addr, n);
+        add_usb_read(q, p, n);
+        add_fel_status(q);
+        addr += n;
+        p += n;
+        len -= n;
+    }
+}
+
+void usb_queue_exec(struct usb_queue *q, uint32_t addr)
+{
+    add_fel_request(q, AW_FEL_1_EXEC, addr, 0);
+    add_fel_status(q);
+}
+
+static void LIBUSB_CALL usb_step_done(struct libusb_transfer *xfer)
+{
+    struct usb_step *s = xfer->user_data;
+    s->done = 1;
+}
+
+static int usb_step_submit(struct usb_queue *q, struct usb_step *s, struct libusb_transfer *xfer)
+{
+    int ep = (s->kind == STEP_OUT) ? q->ctx->epout : q->ctx->epin;
+    uint8_t *data = s->data ? s->data : s->hdr;
+
+    s->xfer = xfer;
+    libusb_fill_bulk_transfer(xfer, q->ctx->hdl, ep, data, s->len, usb_step_done, s, USB_TIMEOUT);
+    if (libusb_submit_transfer(xfer) != 0) {
+        s->done = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static int usb_step_check(struct usb_step *s)
+{
+    struct libusb_transfer *xfer = s->xfer;
+
+    if (xfer->status != LIBUSB_TRANSFER_COMPLETED || (uint32_t)xfer->actual_length != s->len) {
+        printf("USB transfer failed! (status %d, %d of %u bytes)\n", xfer->status, xfer->actual_length, s->len);
+        return 0;
+    }
+    if (s->kind == STEP_AWUS && memcmp(s->hdr, "AWUS", 4) != 0) {
+        printf("Unexpected FEL response!\n");
+        return 0;
+    }
+    return 1;
+}
+
+int usb_queue_flush(struct usb_queue *q)
+{
+    struct libusb_transfer *pool[USB_URBS];
+    size_t submitted = 0, reaped = 0;
+    int ok = !q->failed;
+
+    for (size_t i = 0; i < USB_URBS; i++) {
+        if (!(pool[i] = libusb_alloc_transfer(0))) {
+            while (i--) {
+                libusb_free_transfer(pool[i]);
+            }
+            q->nsteps = 0;
+            return 0;
+        }
+    }
+
+    while (reaped < submitted || (ok && submitted < q->nsteps)) {
+        while (ok && submitted < q->nsteps && submitted - reaped < USB_URBS) {      // Keep the window full
+            if (!usb_step_submit(q, &q->steps[submitted], pool[submitted % USB_URBS])) {
+                printf("Unable to submit USB transfer!\n");
+                ok = 0;
+            }
+            submitted++;
+        }
+
+        struct usb_step *s = &q->steps[reaped];                                     // Reap in order
+        while (!s->done) {
+            int r = libusb_handle_events_completed(NULL, &s->done);
+            if (r != 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+                printf("USB event handling failed! (%d)\n", r);
+                q->nsteps = 0;
+                return 0;                                                           // Transfers may still be in flight, don't free them
+            }
+        }
+        if (ok && !usb_step_check(s)) {
+            ok = 0;
+            for (size_t i = reaped + 1; i < submitted; i++) {
+                libusb_cancel_transfer(q->steps[i].xfer);
+            }
+        }
+        reaped++;
+    }
+
+    for (size_t i = 0; i < USB_URBS; i++) {
+        libusb_free_transfer(pool[i]);
+    }
+    q->nsteps = 0;
+    q->failed = 0;
+    return ok;
+}
+
+int usb_fel_write(struct xfel_ctx_t *ctx, uint32_t addr, const void *buf, size_t len)
+{
+    struct usb_queue q;
+    usb_queue_init(&q, ctx);
+    usb_queue_write(&q, addr, buf, len);
+    int ok = usb_queue_flush(&q);
+    usb_queue_free(&q);
+    return ok;
+}
+
+int usb_fel_read(struct xfel_ctx_t *ctx, uint32_t addr, void *buf, size_t len)
+{
+    struct usb_queue q;
+    usb_queue_init(&q, ctx);
+    usb_queue_read(&q, addr, buf, len);
+    int ok = usb_queue_flush(&q);
+    usb_queue_free(&q);
+    return ok;
+}
+
+int usb_port_path(libusb_device *dev, char *path, size_t len)
+{
+    uint8_t ports[7];                                       // Maximum hub depth allowed by the USB spec
+    int n = libusb_get_port_numbers(dev, ports, sizeof (ports));
+    size_t off;
+
+    if (n < 1) {
+        return 0;
+    }
+    off = snprintf(path, len, "%u-%u", libusb_get_bus_number(dev), ports[0]);
+    for (int i = 1; i < n && off < len; i++) {
+        off += snprintf(&path[off], len - off, ".%u", ports[i]);
+    }
+    return off < len;
+}
+
+static int usb_is_fel(libusb_device *dev)
+{
+    struct libusb_device_descriptor desc;
+    return libusb_get_device_descriptor(dev, &desc) == 0 && desc.idVendor == USB_FEL_VID && desc.idProduct == USB_FEL_PID;
+}
+
+// Port paths of at most max FEL devices, returns how many were found
+size_t usb_fel_devices(char (*paths)[USB_PATH_MAX], size_t max)
+{
+    libusb_device **list;
+    ssize_t n = libusb_get_device_list(NULL, &list);
+    size_t found = 0;
+
+    if (n < 0) {
+        return 0;
+    }
+    for (ssize_t i = 0; i < n && found < max; i++) {
+        if (usb_is_fel(list[i]) && usb_port_path(list[i], paths[found], USB_PATH_MAX)) {
+            found++;
+        }
+    }
+    libusb_free_device_list(list, 1);
+    return found;
+}
+
+libusb_device_handle * usb_open_path(const char *path)
+{
+    libusb_device **list;
+    libusb_device_handle *hdl = NULL;
+    ssize_t n = libusb_get_device_list(NULL, &list);
+    char p[USB_PATH_MAX];
+
+    if (n < 0) {
+        return NULL;
+    }
+    for (ssize_t i = 0; i < n && !hdl; i++) {
+        if (usb_is_fel(list[i]) && usb_port_path(list[i], p, sizeof (p)) && !strcmp(p, path)) {
+            if (libusb_open(list[i], &hdl) != 0) {
+                hdl = NULL;
+                break;
+            }
+        }
+    }
+    libusb_free_device_list(list, 1);
+    return hdl;
+}
+
+int usb_high_speed(libusb_device_handle *hdl)
+{
+    return libusb_get_device_speed(libusb_get_device(hdl)) >= LIBUSB_SPEED_HIGH;
+}
+
+void usb_backoff_init(struct usb_backoff *b)
+{
+    b->elapsed = 0;
+    b->delay = REENUM_POLL;
+}
+
+// Sleep before the next poll, 0 once the device had all the time it gets
+int usb_backoff_wait(struct usb_backoff *b)
+{
+    if (b->elapsed >= REENUM_TIMEOUT) {
+        return 0;
+    }
+    usleep(b->delay * 1000);
+    b->elapsed += b->delay;
+    b->delay = (b->delay * 2 > REENUM_POLL_MAX) ? REENUM_POLL_MAX : b->delay * 2;
+    return 1;
+}
+
+// Whether hdl is the device back from the switch, rather than the one leaving
+int usb_reenumerated(libusb_device_handle *hdl, const struct usb_backoff *b)
+{
+    int speed = libusb_get_device_speed(libusb_get_device(hdl));
+    return speed >= LIBUSB_SPEED_HIGH || (speed == LIBUSB_SPEED_UNKNOWN && b->elapsed >= REENUM_TRUST);
+}
@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright 2024      Jorenar
+ */
+
+#ifndef USB_H_
+#define USB_H_
+
+#include <fel.h>
+
+#define USB_URBS        32                  // Bulk transfers kept in flight
+#define USB_FEL_CHUNK   (64U*1024)          // Largest single FEL read/write request
+#define USB_FEL_VID     0x1f3a
+#define USB_FEL_PID     0xefe8
+#define USB_PATH_MAX    32                  // "bus-port.port...", see usb_port_path()
+
+struct usb_step;
+
+/*
+ * Queue of FEL requests sent over asynchronous bulk transfers.
+ *
+ * Each FEL request expands into the usual AWUC/data/AWUS exchange. The queue
+ * keeps up to USB_URBS of those transfers submitted at once, so the per
+ * transfer turnaround of the host stack overlaps with the data phase of
+ * others, instead of being paid for every one of them in turn. The device
+ * still sees them strictly in order, as each endpoint is a FIFO.
+ */
+struct usb_queue {
+    struct xfel_ctx_t *ctx;
+    struct usb_step *steps;
+    size_t nsteps, cap;
+    int failed;
+};
+
+void usb_queue_init(struct usb_queue *q, struct xfel_ctx_t *ctx);
+void usb_queue_free(struct usb_queue *q);
+void usb_queue_write(struct usb_queue *q, uint32_t addr, const void *buf, size_t len);
+void usb_queue_read(struct usb_queue *q, uint32_t addr, void *buf, size_t len);
+void usb_queue_exec(struct usb_queue *q, uint32_t addr);
+int usb_queue_flush(struct usb_queue *q);
+
+/*
+ * Devices are told apart by the hub port they are plugged into, which, unlike
+ * the device address, survives the re-enumeration after the switch to high
+ * speed.
+ */
+int usb_port_path(libusb_device *dev, char *path, size_t len);
+size_t usb_fel_devices(char (*paths)[USB_PATH_MAX], size_t max);
+libusb_device_handle * usb_open_path(const char *path);
+
+/*
+ * Writing the USB PHY makes the device drop off the bus and come back in high
+ * speed mode, which usually takes well under a second. Callers poll for it
+ * with a short, growing delay instead of whole seconds, and only take a handle
+ * once it reports high speed, so the old full speed instance still on its way
+ * out is never picked up. Where the OS doesn't report the speed, a device is
+ * trusted after a second, as before.
+ */
+struct usb_backoff {
+    unsigned elapsed, delay;                // ms
+};
+
+int usb_high_speed(libusb_device_handle *hdl);
+void usb_backoff_init(struct usb_backoff *b);
+int usb_backoff_wait(struct usb_backoff *b);
+int usb_reenumerated(libusb_device_handle *hdl, const struct usb_backoff *b);
+
+int usb_fel_write(struct xfel_ctx_t *ctx, uint32_t addr, const void *buf, size_t len);
+int usb_fel_read(struct xfel_ctx_t *ctx, uint32_t addr, void *buf, size_t len);
+
+#endif // USB_H_